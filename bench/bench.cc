@@ -0,0 +1,124 @@
+/* Micro-benchmarks of the per-access overhead of regtest */
+// Each phase is timed over scripts of 10 to 10^7 operations, and reports the
+// time and the number of heap allocations per operation. Small scripts are
+// repeated so that every measure covers at least a million operations.
+
+#include "regtest.h"
+
+#include <chrono>
+#include <new>
+
+static size_t allocs = 0;
+
+void* operator new(size_t size) {
+    allocs++;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+typedef struct {
+    Reg32 cr;
+    Reg32 dr;
+    Reg32 isr;
+} Device;
+
+static volatile Device* dev = (volatile Device*) 0x20000800;
+
+static uint32_t sink;
+
+typedef void (*Phase)(size_t n);
+
+static void phase_expect_write(size_t n) {
+    for (size_t i = 0; i < n; i++)
+        expect_write(&dev->dr, i);
+}
+
+static void phase_write(size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dev->dr = i;
+}
+
+static void phase_expect_read(size_t n) {
+    for (size_t i = 0; i < n; i++)
+        expect_read(&dev->isr, i);
+}
+
+static void phase_read(size_t n) {
+    uint32_t acc = 0;
+    for (size_t i = 0; i < n; i++)
+        acc += dev->isr;
+    sink = acc;
+}
+
+static void phase_expect_poll(size_t n) {
+    expect_poll_until(&dev->isr, 0, 1, n);
+}
+
+static void phase_poll(size_t n) {
+    size_t reads = 1;
+    while (dev->isr == 0)
+        reads++;
+    sink = reads == n;
+}
+
+static void phase_script(size_t n) {
+    phase_expect_write(n);
+    phase_write(n);
+}
+
+static void phase_rest(size_t n) {
+    (void) n;
+    expect_rest();
+}
+
+/* Time one phase over n operations: setup and teardown are run around it for
+ * every repetition but are not timed. */
+static void bench(const char *name, size_t n, Phase setup, Phase phase,
+                                                          Phase teardown) {
+    size_t reps = n < 1000000 ? 1000000 / n : 1;
+    double ns = 0;
+    size_t nallocs = 0;
+    for (size_t r = 0; r < reps; r++) {
+        if (setup)
+            setup(n);
+        size_t a = allocs;
+        std::chrono::steady_clock::time_point t0 =
+                                      std::chrono::steady_clock::now();
+        phase(n);
+        std::chrono::steady_clock::time_point t1 =
+                                      std::chrono::steady_clock::now();
+        nallocs += allocs - a;
+        ns += std::chrono::duration<double, std::nano>(t1 - t0).count();
+        if (teardown)
+            teardown(n);
+    }
+    printf("%-24s %9zu %10.2f %12.6f\n", name, n, ns / (reps * n),
+                                        (double) nallocs / (reps * n));
+}
+
+int main() {
+    printf("%-24s %9s %10s %12s\n", "phase", "ops", "ns/op", "allocs/op");
+    for (size_t n = 10; n <= 10000000; n *= 10) {
+        bench("expect_write", n, nullptr, phase_expect_write, phase_write);
+        bench("write", n, phase_expect_write, phase_write, nullptr);
+        bench("expect_read", n, nullptr, phase_expect_read, phase_read);
+        bench("read", n, phase_expect_read, phase_read, nullptr);
+        bench("expect_poll_until", n, nullptr, phase_expect_poll, phase_poll);
+        bench("poll", n, phase_expect_poll, phase_poll, nullptr);
+        /* In check mode, expect_rest() only finds the queue empty, whatever
+         * n: the bulk check of deferred mode is timed instead */
+        regtest_set_mode(REGTEST_DEFERRED);
+        bench("write (deferred)", n, phase_expect_write, phase_write,
+                                                          phase_rest);
+        bench("expect_rest (deferred)", n, phase_script, phase_rest,
+                                                         nullptr);
+        regtest_set_mode(REGTEST_CHECK);
+    }
+    return 0;
+}
@@ -0,0 +1,617 @@
+/* Test cases of a small UART, timer, sensor and DMA driver, run by the test
+ * runner of regtest. Each case shows one feature of the library, and checks
+ * that it behaves as documented. The failures are let through, so that the
+ * cases can check that a faulty driver is caught. */
+
+#define REGTEST_FAIL REGTEST_FAIL_CONTINUE
+#include "regtest.h"
+
+#include <string>
+#include <thread>
+#include <sys/wait.h>
+
+struct Uart {
+    Reg32 cr;
+    Reg32 sr;
+    Reg32 dr;
+};
+
+struct Timer {
+    Reg32 cr;
+    Reg32 cnt;
+};
+
+struct Sensor {
+    Reg32 sr;
+    Reg32 dr;
+};
+
+struct Dma {
+    Reg32 src;
+    Reg32 dst;
+    Reg32 len;
+    Reg32 cr;
+    Reg32 isr;
+};
+
+enum { UART_EN = 0x01, UART_TXE = 0x02, UART_RXNE = 0x04 };
+enum { DMA_START = 0x01, DMA_DONE = 0x01, TIMER_EN = 0x01 };
+enum { SENSOR_FIFO = 16 };    // samples, whose number is in bits 8-15 of sr
+
+/* Register banks of the mock peripherals */
+static uint64_t uart_mem[2], timer_mem[1], sensor_mem[1], dma_mem[3];
+static volatile Uart *uart = (volatile Uart*) uart_mem;
+static volatile Timer *timer = (volatile Timer*) timer_mem;
+static volatile Sensor *sensor = (volatile Sensor*) sensor_mem;
+static volatile Dma *dma = (volatile Dma*) dma_mem;
+
+
+/* The driver */
+
+static void uart_init() {
+    uart->cr = 0;
+    uart->cr = UART_EN;
+}
+
+static void uart_putc(uint8_t c) {
+    while (!(uart->sr & UART_TXE)) {}
+    uart->dr = c;
+}
+
+/* Receive a character, along with the status it came with */
+static uint8_t uart_getc(uint32_t *status) {
+    *status = uart->sr;
+    return (uint8_t) uart->dr;
+}
+
+/* Write len bytes to the FIFO of the UART, which has room for them */
+static void uart_write(const uint32_t *buf, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++)
+        uart->dr = buf[i];
+}
+
+/* Interrupt handler of the UART: keep the received character */
+static uint32_t uart_rx;
+
+static void uart_isr() {
+    uart_rx = uart->dr;
+}
+
+/* Move the samples of the FIFO of the sensor to buf, which has room for
+ * SENSOR_FIFO samples */
+static uint32_t sensor_drain(uint32_t *buf) {
+    uint32_t n = (sensor->sr >> 8) & 0xff;
+    if (n > SENSOR_FIFO)
+        n = SENSOR_FIFO;
+    for (uint32_t i = 0; i < n; i++)
+        buf[i] = sensor->dr;
+    return n;
+}
+
+/* Busy wait for "ticks" ticks of the timer */
+static void timer_delay(uint32_t ticks) {
+    timer->cr = TIMER_EN;
+    while (timer->cnt < ticks) {}
+    timer->cr = 0;
+}
+
+static void dma_config(uint32_t src, uint32_t dst, uint32_t len) {
+    dma->len = len;
+    dma->dst = dst;
+    dma->src = src;
+}
+
+/* Send len bytes at src to the UART by DMA, and wait for the end */
+static void uart_send_dma(uint32_t src, uint32_t len) {
+    dma_config(src, (uint32_t) (uintptr_t) &uart->dr, len);
+    uart->cr = UART_EN | UART_TXE;
+    dma->cr = DMA_START;
+    while (!(dma->isr & DMA_DONE)) {}
+    uart->cr = UART_EN;
+}
+
+/* Same as uart_putc, but writes the character twice */
+static void uart_putc_faulty(uint8_t c) {
+    uart_putc(c);
+    uart->dr = c;
+}
+
+/* Same as sensor_drain, but trusts the number of samples of the sensor */
+static uint32_t sensor_drain_faulty(uint32_t *buf) {
+    uint32_t n = (sensor->sr >> 8) & 0xff;
+    for (uint32_t i = 0; i < n; i++)
+        buf[i] = sensor->dr;
+    return n;
+}
+
+/* Same as uart_getc, but reads the status twice */
+static uint8_t uart_getc_faulty(uint32_t *status) {
+    *status = uart->sr;
+    return uart_getc(status);
+}
+
+
+/* The tests */
+
+static void expect_uart_init() {
+    expect_write(&uart->cr, 0u);
+    expect_write(&uart->cr, (uint32_t) UART_EN);
+}
+
+static void expect_putc(uint8_t c) {
+    expect_read(&uart->sr, (uint32_t) UART_TXE);
+    expect_write(&uart->dr, (uint32_t) c);
+}
+
+/* The addresses may be written in any order */
+static void expect_dma_addresses(uint32_t src, uint32_t dst) {
+    expect_any_order {
+        expect_write(&dma->src, src);
+        expect_write(&dma->dst, dst);
+    }
+}
+
+/* Each peripheral keeps its own order, not their interleaving */
+REGTEST_CASE(streams) {
+    RegStream uart_stream(uart, sizeof *uart);
+    RegStream dma_stream(dma, sizeof *dma);
+    expect_write(&uart->cr, (uint32_t) (UART_EN | UART_TXE));
+    expect_write(&uart->cr, (uint32_t) UART_EN);
+    expect_write(&dma->len, 16u);
+    expect_write(&dma->dst, (uint32_t) (uintptr_t) &uart->dr);
+    expect_write(&dma->src, 0x2000u);
+    expect_write(&dma->cr, (uint32_t) DMA_START);
+    expect_poll_until(&dma->isr, 0u, (uint32_t) DMA_DONE, 4);
+    uart_send_dma(0x2000, 16);
+    if (expect_rest())
+        regtest_fail("The streams did not match.");
+}
+
+/* A group of the helper nested in the group of the case is part of it */
+REGTEST_CASE(any_order) {
+    expect_any_order {
+        expect_write(&dma->len, 4u);
+        expect_dma_addresses(0x3000, 0x4000);
+    }
+    expect_write(&uart->cr, 0u);
+    dma_config(0x3000, 0x4000, 4);
+    uart->cr = 0;
+}
+
+/* A timer which ticks once per read of its counter while enabled. It is
+ * built once, before the runner forks the cases. */
+struct TimerModel : RegModel {
+    TimerModel() : RegModel(timer, sizeof *timer) {}
+    uint64_t on_read(const volatile void *adr) {
+        return adr == &timer->cnt ? (cnt += en) : en;
+    }
+    void on_write(const volatile void *adr, uint64_t val) {
+        if (adr == &timer->cr)
+            en = val & TIMER_EN;
+        else
+            regtest_fail("Write of the timer counter.");
+    }
+    uint64_t cnt = 0;
+    bool en = false;
+};
+
+static TimerModel timer_model;
+
+REGTEST_CASE(models) {
+    timer_delay(1000);
+    if (timer_model.cnt != 1000 || timer_model.en)
+        regtest_fail("The timer ticked %llu times.",
+                     (unsigned long long) timer_model.cnt);
+}
+
+/* Each variant starts from the same initialization script */
+REGTEST_CASE(checkpoints) {
+    expect_uart_init();
+    RegCheckpoint init;
+    for (unsigned c = 0; c < 256; c++) {
+        init.restore();
+        expect_putc((uint8_t) c);
+        uart_init();
+        uart_putc((uint8_t) c);
+        if (expect_rest())
+            regtest_fail("Variant %u failed.", c);
+    }
+}
+
+/* Output of the library, kept in a string */
+struct StringSink : RegSink {
+    void text(const char *s, size_t len) { out.append(s, len); }
+    void access(uint64_t, const Access&) { accesses++; }
+    std::string out;
+    size_t accesses = 0;
+};
+
+/* The extra write of the faulty driver, in the middle of the test, shows up
+ * as a single line of the differences */
+REGTEST_CASE(diff) {
+    StringSink sink;
+    regtest_set_sink(&sink);
+    for (unsigned c = 0; c < 100; c++)
+        expect_putc((uint8_t) c);
+    for (unsigned c = 0; c < 100; c++)
+        c == 50 ? uart_putc_faulty((uint8_t) c) : uart_putc((uint8_t) c);
+    int failed = expect_rest();
+    regtest_set_sink(nullptr);
+    if (!failed || sink.out.find("  + access #102, unexpected write of 0x00000032")
+                   == std::string::npos)
+        regtest_fail("The extra write was not reported:\n%s", sink.out.c_str());
+}
+
+/* So does an extra read, although it shifts the values served to the reads
+ * that follow it */
+REGTEST_CASE(diff_read) {
+    StringSink sink;
+    regtest_set_sink(&sink);
+    for (unsigned c = 0; c < 100; c++) {
+        expect_read(&uart->sr, (uint32_t) UART_RXNE);
+        expect_read(&uart->dr, (uint32_t) c);
+    }
+    uint32_t status;
+    for (unsigned c = 0; c < 100; c++)
+        c == 50 ? uart_getc_faulty(&status) : uart_getc(&status);
+    int failed = expect_rest();
+    regtest_set_sink(nullptr);
+    if (!failed || sink.out.find("  + access #101, unexpected read") ==
+                   std::string::npos ||
+                   sink.out.find("1 unexpected access(es)") == std::string::npos)
+        regtest_fail("The extra read was not reported:\n%s", sink.out.c_str());
+}
+
+/* The driver runs in another process, the script in this one */
+REGTEST_CASE(shm) {
+    char name[64];
+    snprintf(name, sizeof name, "/regtest_cases_%d", (int) getpid());
+    RegShm script;
+    if (script.create(name, uart)) {
+        regtest_fail("Could not create %s.", name);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        RegShm tested;
+        if (tested.open(name, uart))
+            _exit(2);
+        expect_from_shm(tested);
+        uart_init();
+        for (unsigned c = 0; c < 1000; c++)
+            uart_putc((uint8_t) c);
+        tested.close(expect_rest());
+        _exit(0);
+    }
+    expect_to_shm(script);
+    expect_uart_init();
+    for (unsigned c = 0; c < 1000; c++)
+        expect_putc((uint8_t) c);
+    int failed = expect_rest();
+    int status;
+    waitpid(pid, &status, 0);
+    Access a;
+    size_t n = 0;
+    while (script.next_access(a))
+        n++;
+    if (failed || n != 2002)
+        regtest_fail("The tested process made %zu accesses.", n);
+}
+
+/* The accesses logged through an asynchronous sink all reach its target */
+REGTEST_CASE(sinks) {
+    StringSink sink;
+    RegAsyncSink async(sink);
+    regtest_set_sink(&async);
+    regtest_log_accesses(true);
+    expect_uart_init();
+    for (unsigned c = 0; c < 1000; c++)
+        expect_putc((uint8_t) c);
+    uart_init();
+    for (unsigned c = 0; c < 1000; c++)
+        uart_putc((uint8_t) c);
+    regtest_print("sent\n");
+    async.flush();
+    regtest_log_accesses(false);
+    regtest_set_sink(nullptr);
+    if (sink.accesses != 2002 || sink.out != "sent\n")
+        regtest_fail("The sink got %zu accesses.", sink.accesses);
+}
+
+/* The accesses are only checked at expect_rest() */
+REGTEST_CASE(deferred) {
+    regtest_set_mode(REGTEST_DEFERRED);
+    expect_uart_init();
+    for (unsigned c = 0; c < 100; c++)
+        expect_putc((uint8_t) c);
+    uart_init();
+    for (unsigned c = 0; c < 100; c++)
+        uart_putc((uint8_t) c);
+    int good = expect_rest();
+    expect_uart_init();
+    uart->cr = UART_EN;
+    int bad = expect_rest();
+    regtest_set_mode(REGTEST_CHECK);
+    if (good || !bad)
+        regtest_fail("The deferred checks gave %d and %d.", good, bad);
+}
+
+/* A recorded trace replays the accesses of the driver */
+REGTEST_CASE(traces) {
+    char path[64];
+    snprintf(path, sizeof path, "/tmp/regtest_cases_%d.trace", (int) getpid());
+    if (trace_record(path, uart)) {
+        regtest_fail("Could not record %s.", path);
+        return;
+    }
+    ((uint32_t*) uart_mem)[offsetof(Uart, sr) / 4] = UART_TXE;
+    uart_init();
+    for (unsigned c = 0; c < 100; c++)
+        uart_putc((uint8_t) c);
+    if (trace_stop())
+        regtest_fail("Could not write %s.", path);
+    expect_from_trace(path, uart);
+    uart_init();
+    for (unsigned c = 0; c < 100; c++)
+        uart_putc((uint8_t) c);
+    int good = expect_rest();
+    expect_from_trace(path, uart);
+    uart_init();
+    for (unsigned c = 0; c < 100; c++)
+        uart_putc((uint8_t) (c == 50 ? 0 : c));
+    int bad = expect_rest();
+    unlink(path);
+    if (good || !bad)
+        regtest_fail("The replays gave %d and %d.", good, bad);
+}
+
+/* Static scripts, in read-only memory, and a script of two peripherals */
+enum { UART, DMA };
+
+static constexpr SOp uart_init_script[] = {
+    SCRIPT_WRITE(Uart, cr, 0),
+    SCRIPT_WRITE(Uart, cr, UART_EN),
+};
+
+static constexpr POp send_script[] = {
+    PERIPH_WRITE(DMA, Dma, len, 8),
+    PERIPH_WRITE(DMA, Dma, dst, 0),
+    PERIPH_WRITE(DMA, Dma, src, 0x1000),
+    PERIPH_WRITE(UART, Uart, cr, UART_EN | UART_TXE),
+    PERIPH_WRITE(DMA, Dma, cr, DMA_START),
+    PERIPH_READ(DMA, Dma, isr, DMA_DONE),
+    PERIPH_WRITE(UART, Uart, cr, UART_EN),
+};
+
+REGTEST_CASE(scripts) {
+    expect_script(uart, uart_init_script);
+    uart_init();
+    regtest_bind(UART, uart);
+    regtest_bind(DMA, dma);
+    expect_script(send_script);
+    dma_config(0x1000, 0, 8);
+    uart->cr = UART_EN | UART_TXE;
+    dma->cr = DMA_START;
+    while (!(dma->isr & DMA_DONE)) {}
+    uart->cr = UART_EN;
+    if (expect_rest())
+        regtest_fail("The scripts did not match.");
+}
+
+/* A block takes one place in the queue for the whole transfer */
+REGTEST_CASE(blocks) {
+    uint32_t buf[4096];
+    for (unsigned i = 0; i < 4096; i++)
+        buf[i] = i & 0xff;
+    expect_write_block(&uart->dr, buf, 4096);
+    uart_write(buf, 4096);
+    int good = expect_rest();
+    uint32_t sent[4096];
+    memcpy(sent, buf, sizeof sent);
+    sent[1000] = 0x100;
+    expect_write_block(&uart->dr, buf, 4096);
+    uart_write(sent, 4096);
+    int bad = expect_rest();
+    if (good || !bad)
+        regtest_fail("The blocks gave %d and %d.", good, bad);
+}
+
+/* The DMA completes on the fourth read of its status */
+REGTEST_CASE(generators) {
+    RegStream uart_stream(uart, sizeof *uart);
+    unsigned reads = 0;
+    expect_write(&dma->len, 16u);
+    expect_write(&dma->dst, (uint32_t) (uintptr_t) &uart->dr);
+    expect_write(&dma->src, 0x2000u);
+    expect_write(&dma->cr, (uint32_t) DMA_START);
+    expect_read_gen(&dma->isr, 4, [&reads]() {
+        return ++reads == 4 ? (uint32_t) DMA_DONE : 0u;
+    });
+    expect_write(&uart->cr, (uint32_t) (UART_EN | UART_TXE));
+    expect_write(&uart->cr, (uint32_t) UART_EN);
+    uart_send_dma(0x2000, 16);
+    if (expect_rest() || reads != 4)
+        regtest_fail("The DMA status was read %u times.", reads);
+}
+
+/* The interrupt handler runs right after the status read, and its accesses
+ * are checked in turn */
+REGTEST_CASE(interrupts) {
+    expect_read(&uart->sr, (uint32_t) UART_TXE);
+    expect_interrupt(uart_isr);
+    expect_read(&uart->dr, 0x42u);
+    expect_write(&uart->dr, 0x21u);
+    uart_putc(0x21);
+    if (expect_rest() || uart_rx != 0x42)
+        regtest_fail("The handler received 0x%x.", uart_rx);
+}
+
+/* A simulator thread feeds the expected operations while the driver runs */
+REGTEST_CASE(channels) {
+    RegChannel channel(64);
+    std::thread simulator([&channel]() {
+        for (unsigned c = 0; c < 10000; c++) {
+            channel.expect_poll_until(&uart->sr, 0u, (uint32_t) UART_TXE, 3);
+            channel.expect_write(&uart->dr, (uint32_t) (c & 0xff));
+        }
+        channel.close();
+    });
+    expect_from_channel(channel);
+    for (unsigned c = 0; c < 10000; c++)
+        uart_putc((uint8_t) c);
+    int failed = expect_rest();
+    simulator.join();
+    if (failed)
+        regtest_fail("The channel did not match.");
+}
+
+/* The bus time of the accesses, checked against a budget */
+REGTEST_CASE(bus_cycles) {
+    bus_cost(uart, sizeof *uart, 10, 20);
+    StringSink sink;
+    regtest_set_sink(&sink);
+    for (unsigned c = 0; c < 100; c++)
+        expect_putc((uint8_t) c);
+    for (unsigned c = 0; c < 100; c++)
+        uart_putc((uint8_t) c);
+    uint64_t t = bus_time();
+    int good = expect_rest();
+    expect_bus_budget(3000);
+    for (unsigned c = 0; c < 101; c++)
+        expect_putc((uint8_t) c);
+    for (unsigned c = 0; c < 101; c++)
+        uart_putc((uint8_t) c);
+    int bad = expect_rest();
+    regtest_set_sink(nullptr);
+    if (t != 3000 || good || !bad)
+        regtest_fail("The bus time was %llu.", (unsigned long long) t);
+}
+
+/* The counters and the analysis find the polling of the timer */
+REGTEST_CASE(instrumentation) {
+    StringSink sink;
+    regtest_set_sink(&sink);
+    regstats_enable(true);
+    regtest_analyze_enable(true);
+    timer_delay(100);
+    int failed = expect_rest();
+    regstats_enable(false);
+    regtest_analyze_enable(false);
+    regtest_set_sink(nullptr);
+    char line[128];
+    snprintf(line, sizeof line, "%-18p %12llu %12llu", (void*) &timer->cnt,
+                                                      100ull, 0ull);
+    if (failed || sink.out.find(line) == std::string::npos ||
+                  sink.out.find("polling, no backoff") == std::string::npos)
+        regtest_fail("The reports missed the timer:\n%s", sink.out.c_str());
+}
+
+/* A runaway loop is stopped by its budget, even when the failures are let
+ * through */
+REGTEST_CASE(budgets) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        StringSink sink;
+        regtest_set_sink(&sink);
+        expect_access_budget(timer, sizeof *timer, 1000);
+        timer_delay(UINT32_MAX);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT)
+        regtest_fail("The runaway loop was not stopped.");
+}
+
+/* A range which overlaps another one of its kind fails */
+REGTEST_CASE(overlaps) {
+    StringSink sink;
+    regtest_set_sink(&sink);
+    RegStream uart_stream(uart, sizeof *uart);
+    RegStream sr_stream(&uart->sr, sizeof uart->sr);
+    unsigned streams = regfailures;
+    bus_cost(timer, sizeof *timer, 10, 20);
+    bus_cost(&timer->cnt, sizeof timer->cnt, 1, 1);
+    expect_access_budget(dma, sizeof *dma, 100);
+    expect_access_budget(&dma->len, sizeof dma->len, 10);
+    unsigned total = regfailures;
+    int failed = expect_rest();
+    regtest_set_sink(nullptr);
+    if (streams != 1 || total != 3 || !failed)
+        regtest_fail("%u overlaps were caught.", total);
+}
+
+/* Each thread checks its accesses against its own queue */
+REGTEST_CASE(threads) {
+    int failed[4];
+    std::vector<std::thread> tests;
+    for (int i = 0; i < 4; i++)
+        tests.push_back(std::thread([&failed, i]() {
+            expect_uart_init();
+            for (unsigned c = 0; c < 1000; c++)
+                expect_putc((uint8_t) (c + i));
+            uart_init();
+            for (unsigned c = 0; c < 1000; c++)
+                uart_putc((uint8_t) (c + i));
+            failed[i] = expect_rest();
+        }));
+    for (int i = 0; i < 4; i++) {
+        tests[i].join();
+        if (failed[i])
+            regtest_fail("Thread %d failed.", i);
+    }
+}
+
+/* A sensor which always holds four samples. The fuzzer corrupts their
+ * number. */
+struct SensorModel : RegModel {
+    SensorModel() : RegModel(sensor, sizeof *sensor) {}
+    uint64_t on_read(const volatile void *adr) {
+        return adr == &sensor->sr ? 4 << 8 : samples++;
+    }
+    void on_write(const volatile void*, uint64_t) {
+        regtest_fail("Write to the sensor.");
+    }
+    uint32_t samples = 0;
+};
+
+template <uint32_t (*drain)(uint32_t*)>
+static void sensor_test() {
+    SensorModel model;
+    uint32_t buf[256];              // room for the overflow of the faulty one
+    for (int i = 0; i < 20; i++)
+        if (drain(buf) > SENSOR_FIFO)
+            regtest_fail("Buffer overflow.");
+}
+
+/* The faulty driver fails some seeds, each reproduced by the minimized set of
+ * corruptions that the verdict gives, and the same seeds always fail */
+REGTEST_CASE(fuzzing) {
+    RegFuzz fuzz;
+    fuzz.fuzz(&sensor->sr, 0xff00, 0.05);
+    StringSink sink;
+    regtest_set_sink(&sink);
+    int bad = regtest_fuzz(fuzz, sensor_test<sensor_drain_faulty>, 1, 16, 1);
+    std::string out = sink.out;
+    sink.out.clear();
+    int again = regtest_fuzz(fuzz, sensor_test<sensor_drain_faulty>, 1, 16, 1);
+    int good = regtest_fuzz(fuzz, sensor_test<sensor_drain>, 1, 16, 1);
+    size_t at = out.find("reproduce with REGTEST_FUZZ=");
+    int reproduced = 0;
+    if (at != std::string::npos) {
+        at += strlen("reproduce with REGTEST_FUZZ=");
+        std::string run = out.substr(at, out.find('\n', at) - at);
+        setenv("REGTEST_FUZZ", run.c_str(), 1);
+        reproduced = regtest_fuzz(fuzz, sensor_test<sensor_drain_faulty>, 0, 0);
+        unsetenv("REGTEST_FUZZ");
+    }
+    regtest_set_sink(nullptr);
+    if (!bad || again != bad || sink.out.compare(0, out.size(), out) ||
+        good || !reproduced)
+        regtest_fail("Fuzzing gave %d, %d and %d failed seeds:\n%s", bad, again,
+                     good, out.c_str());
+}
+
+int main() {
+    return regtest_run() != 0;
+}
@@ -31,6 +31,8 @@ static volatile Device* dev = (volatile Device*) 0x20000800;
 #ifndef TEST
 static void expect_write(volatile void *a, uint32_t v) {(void) a; (void) v;}
 static void expect_read(volatile void *a, uint32_t v) {(void) a; (void) v;}
+static void expect_poll_until(volatile void *a, uint32_t i, uint32_t d,
+                              uint32_t n) {(void) a; (void) i; (void) d; (void) n;}
 static void expect_rest() {}
 #endif
 
@@ -43,9 +45,7 @@ int main() {
     while (dev->isr == 0) {};
     expect_rest();
     expect_write(&dev->dr, 0x20);
-    expect_read(&dev->isr, 0x00);
-    expect_read(&dev->isr, 0x00);
-    expect_read(&dev->isr, 0x01);
+    expect_poll_until(&dev->isr, 0x00, 0x01, 3);
     dev->dr = 0x20;
     while (dev->isr == 0) {};
     expect_rest();
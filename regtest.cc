@@ -0,0 +1,2521 @@
+/* Regtest.cc - Runtime of the peripheral access test library */
+// This file is either included at the end of regtest.h, or compiled on its own
+// with REGTEST_LIB defined, into libregtest.a (see "Compiled Runtime" in
+// regtest.h).
+
+#include "regtest.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace regtest {
+
+thread_local unsigned regfailures = 0;
+
+REGTEST_COLD __attribute__((format(printf, 1, 2)))
+void regtest_fail(const char *fmt, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof msg, fmt, ap);
+    va_end(ap);
+    regtest_print("\n%s\n", msg);
+#if REGTEST_FAIL == REGTEST_FAIL_TRAP
+    regtest_flush();
+    raise(SIGINT);
+#elif REGTEST_FAIL == REGTEST_FAIL_ABORT
+    regtest_flush();
+    abort();
+#elif REGTEST_FAIL == REGTEST_FAIL_THROW
+    regtest_flush();
+    throw RegFailure(msg);
+#else
+    regfailures++;
+#endif
+}
+
+thread_local const volatile void *periph_bases[256];
+
+void regtest_bind(uint8_t periph, const volatile void *base) {
+    periph_bases[periph] = base;
+}
+
+/* Grow the ring so that it holds at least n operations, keeping the queued
+ * ones in order at the start of the new array. */
+void RopRing::reserve(size_t n) {
+    if (n <= buf.size())
+        return;
+    size_t cap = 16;
+    while (cap < n)
+        cap *= 2;
+    std::vector<ROp> nbuf(cap);
+    size_t len = size();
+    for (size_t i = 0; i < len; i++)
+        nbuf[i] = buf[(head + i) & (buf.size() - 1)];
+    buf.swap(nbuf);
+    head = 0;
+    tail = len;
+}
+
+/* Copy of the queued operations, and replacement of the queue by such a copy
+ * (which only allocates if the ring has to grow) */
+void RopRing::save(std::vector<ROp> &ops) {
+    ops.resize(size());
+    for (size_t i = 0; i < ops.size(); i++)
+        ops[i] = (*this)[i];
+}
+
+void RopRing::assign(const std::vector<ROp> &ops) {
+    clear();
+    reserve(ops.size());
+    std::copy(ops.begin(), ops.end(), buf.begin());
+    tail = ops.size();
+}
+
+thread_local RegMode regmode = REGTEST_CHECK;
+thread_local RegStream ropq;
+thread_local std::vector<StreamRange> regstreams;
+thread_local StreamRange *regstream_last = nullptr;
+
+/* The thread_local state is destroyed when the thread exits, before the
+ * streams of static storage duration, such as the models shared by the cases
+ * of the runner, and before ropq: the sentry, destroyed first, tells their
+ * destructors to leave regstreams alone. */
+thread_local bool regstreams_gone = false;
+
+struct StreamSentry {
+    ~StreamSentry() {
+        regstreams.clear();
+        regstream_last = nullptr;
+        regstreams_gone = true;
+    }
+};
+
+thread_local StreamSentry regstream_sentry;
+
+RegStream::RegStream(const volatile void *base, size_t size) : checked(0),
+                      log_base(0), rd_op(0), rd_done(0), model(nullptr),
+                      rd_script{nullptr, 0}, rd_script_op(0) {
+    StreamRange r = {(uintptr_t) base, (uintptr_t) base + size, this};
+    if (!range_insert(regstreams, regstream_last, r))
+        regtest_fail("The range of the stream at %p overlaps another stream.",
+                     base);
+}
+
+RegStream::~RegStream() {
+    if (regstreams_gone)
+        return;
+    for (size_t i = 0; i < regstreams.size(); i++) {
+        if (regstreams[i].stream == this) {
+            regstreams.erase(regstreams.begin() + i);
+            break;
+        }
+    }
+    regstream_last = nullptr;
+}
+
+REGTEST_NOINLINE RegStream& reg_route_find(const volatile void *adr) {
+    StreamRange *r = range_find(regstreams, regstream_last, (uintptr_t) adr);
+    return r ? *r->stream : ropq;
+}
+
+static const char TRACE_MAGIC[8] = {'R', 'G', 'T', 'R', 'A', 'C', 'E', 0};
+thread_local FILE     *trace_file = nullptr;
+thread_local uintptr_t trace_base = 0;
+thread_local uint64_t  trace_seq = 0;
+thread_local size_t    trace_len = 0;
+thread_local std::vector<TraceRec> trace_buf;
+
+void trace_flush() {
+    if (trace_len && fwrite(trace_buf.data(), sizeof(TraceRec), trace_len,
+                                                    trace_file) != trace_len)
+        regtest_print("\nFailed to write the register access trace.\n");
+    trace_len = 0;
+}
+
+void trace_access(const volatile void *adr, uint64_t val, uint8_t kind) {
+    if (trace_len == TRACE_BLOCK)
+        trace_flush();
+    TraceRec &rec = trace_buf[trace_len++];
+    rec.adr = (uintptr_t) adr - trace_base;
+    rec.val = val;
+    rec.seq = (trace_seq++ << 8) | kind;
+}
+
+int trace_record(const char *path, const volatile void *base) {
+    TraceHdr hdr;
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof hdr.magic);
+    hdr.version = 1;
+    hdr.recsize = sizeof(TraceRec);
+    trace_file = fopen(path, "wb");
+    if (!trace_file || fwrite(&hdr, sizeof hdr, 1, trace_file) != 1) {
+        regtest_print("\nCannot record register access trace to %s\n", path);
+        if (trace_file)
+            fclose(trace_file);
+        trace_file = nullptr;
+        return 1;
+    }
+    /* Blocks are large enough for the stdio buffer to be a useless copy */
+    setvbuf(trace_file, nullptr, _IONBF, 0);
+    trace_base = (uintptr_t) base;
+    trace_seq = 0;
+    trace_len = 0;
+    trace_buf.resize(TRACE_BLOCK);
+    regmode = REGTEST_RECORD;
+    return 0;
+}
+
+int trace_stop() {
+    int ret = 0;
+    if (trace_file) {
+        trace_flush();
+        ret = fclose(trace_file) != 0;
+        trace_file = nullptr;
+    }
+    regmode = REGTEST_CHECK;
+    return ret;
+}
+
+static size_t group_hash(const volatile void *adr) {
+    uint64_t h = (uintptr_t) adr * 0x9e3779b97f4a7c15ull;
+    return (size_t) (h >> 57);
+}
+
+void RegGroup::add(const ROp &op) {
+    size_t i = group_hash(op.adr);
+    while (index[i].mask && index[i].adr != op.adr)
+        i = (i + 1) % SLOTS;
+    index[i].adr = op.adr;
+    index[i].mask |= 1ull << ops.size();
+    pending |= 1ull << ops.size();
+    if (!(op.kind & ROP_WRITE))
+        rd_pending |= 1ull << ops.size();
+    ops.push_back(op);
+    left.push_back(op.count);
+    rd_left.push_back(op.count);
+    total += op.count;
+}
+
+uint64_t RegGroup::members(const volatile void *adr) const {
+    size_t i = group_hash(adr);
+    while (index[i].mask) {
+        if (index[i].adr == adr)
+            return index[i].mask;
+        i = (i + 1) % SLOTS;
+    }
+    return 0;
+}
+
+/* Member among "pending" that matches an access, or -1 */
+int RegGroup::find(uint64_t pending, const uint32_t *left,
+                   const volatile void *adr, uint64_t v, uint8_t kind) const {
+    for (uint64_t m = members(adr) & pending; m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        if (ops[i].kind == kind && (!(kind & ROP_WRITE) || value(i, left) == v))
+            return i;
+    }
+    return -1;
+}
+
+thread_local std::vector<RegGroup*> reggroups;
+thread_local RegGroup *reggroup_open = nullptr;
+thread_local unsigned reggroup_depth = 0;
+thread_local std::vector<RegGen*> reggens;
+
+static uint64_t gen_next(const ROp &op) {
+    RegGen *g = (RegGen*) op.ext;
+    return g->next(g);
+}
+
+thread_local std::vector<std::pair<void*, size_t> > trace_maps;
+
+void script_release() {
+    for (size_t i = 0; i < trace_maps.size(); i++)
+        munmap(trace_maps[i].first, trace_maps[i].second);
+    trace_maps.clear();
+    for (size_t i = 0; i < reggroups.size(); i++)
+        if (reggroups[i] != reggroup_open)
+            delete reggroups[i];
+    reggroups.clear();
+    if (reggroup_open)
+        reggroups.push_back(reggroup_open);
+    for (size_t i = 0; i < reggens.size(); i++)
+        reggens[i]->destroy(reggens[i]);
+    reggens.clear();
+}
+
+int expect_from_trace(const char *path, const volatile void *base) {
+#ifdef REGTEST_PASSTHROUGH
+    return 0;
+#endif
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(TraceHdr)) {
+        regtest_print("\nCannot read register access trace %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    size_t size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        regtest_print("\nCannot map register access trace %s\n", path);
+        return 1;
+    }
+    const TraceHdr *hdr = (const TraceHdr*) map;
+    if (memcmp(hdr->magic, TRACE_MAGIC, sizeof hdr->magic) ||
+        hdr->version != 1 || hdr->recsize != sizeof(TraceRec)) {
+        regtest_print("\n%s is not a register access trace\n", path);
+        munmap(map, size);
+        return 1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    trace_maps.push_back(std::make_pair(map, size));
+
+    const TraceRec *rec = (const TraceRec*) (hdr + 1);
+    size_t n = (size - sizeof(TraceHdr)) / sizeof(TraceRec);
+    while (n) {
+        uint32_t chunk = n > UINT32_MAX ? UINT32_MAX : n;
+        rop_queue(ROp(ROP_TRACE, base, rec, chunk));
+        rec += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
+Access trace_op_access(const ROp &op, uint32_t k) {
+    const TraceRec &rec = ((const TraceRec*) op.ext)[k];
+    Access a;
+    a.adr = (const volatile void*) ((uintptr_t) op.adr + rec.adr);
+    a.val = rec.val;
+    a.kind = rec.seq & 0xff;
+    return a;
+}
+
+Access block_op_access(const ROp &op, uint32_t k) {
+    uint8_t kind = op.val;
+    const unsigned char *p = (const unsigned char*) op.ext +
+                             (size_t) k * (kind & ~ROP_WRITE);
+    Access a = {op.adr, 0, kind};
+    switch (kind & ~ROP_WRITE) {
+    case 1: a.val = *p; break;
+    case 2: { uint16_t v; memcpy(&v, p, 2); a.val = v; break; }
+    case 4: { uint32_t v; memcpy(&v, p, 4); a.val = v; break; }
+    default: memcpy(&a.val, p, 8); break;
+    }
+    return a;
+}
+
+ScriptCursor script_cursor(const ROp &op) {
+    ScriptCursor c = {(const SOp*) op.ext, -(int64_t) op.val};
+    return c;
+}
+
+Access script_op_access(const ROp &op, ScriptCursor &c, uint32_t k) {
+    while (c.base + c.e->count <= k) {
+        c.base += c.e->count;
+        c.e++;
+    }
+    Access a = {(const volatile void*) ((uintptr_t) op.adr + c.e->off),
+                k - c.base + 1 == c.e->count ? c.e->last : c.e->val,
+                c.e->kind};
+    return a;
+}
+
+static const volatile void* pop_adr(const POp &e) {
+    return (const volatile void*) ((uintptr_t) periph_bases[e.periph] + e.off);
+}
+
+Access pscript_op_access(const ROp &op, uint32_t k) {
+    const POp &e = ((const POp*) op.ext)[k];
+    Access a = {pop_adr(e), e.val, e.kind};
+    return a;
+}
+
+void regtest_set_mode(RegMode mode) {
+    regmode = mode;
+}
+
+void expect_reserve(size_t n) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    ropq.reserve(n);
+    if (regmode == REGTEST_DEFERRED)
+        ropq.log.reserve(n);
+}
+
+uint64_t deferred_read(RegStream &s, const volatile void *adr, uint8_t kind) {
+    uint64_t ret = (uint64_t) -1;
+    for (; s.rd_op < s.size(); s.rd_op++, s.rd_done = 0) {
+        ROp &op = s[s.rd_op];
+        if (op.type == ROP_SOURCE) {
+            regtest_fail("Channels are only consumed in REGTEST_CHECK mode.");
+            break;
+        } else if (op.type == ROP_IRQ) {
+            regtest_fail("Interrupts are only run in REGTEST_CHECK mode.");
+            break;
+        } else if (op.type == ROP_GROUP) {
+            /* Serve the read member at this address, or the first one */
+            RegGroup &g = *(RegGroup*) op.ext;
+            if (!g.rd_pending)
+                continue;
+            int i = g.find(g.rd_pending, g.rd_left.data(), adr, 0, kind);
+            if (i < 0)
+                i = __builtin_ctzll(g.rd_pending);
+            ret = g.value(i, g.rd_left.data());
+            if (--g.rd_left[i] == 0)
+                g.rd_pending &= ~(1ull << i);
+            if (!g.rd_pending)
+                s.rd_op++;
+            s.log.push_back(Access{adr, ret, kind});
+            return ret;
+        } else if (op.type == ROP_GEN) {
+            ret = gen_next(op);
+            break;
+        } else if (op.type == ROP_TRACE) {
+            for (; s.rd_done < op.count; s.rd_done++) {
+                Access a = trace_op_access(op, s.rd_done);
+                if (!(a.kind & ROP_WRITE)) {
+                    ret = a.val;
+                    break;
+                }
+            }
+            if (s.rd_done < op.count)
+                break;
+        } else if (op.type == ROP_BLOCK) {
+            if (!(op.val & ROP_WRITE)) {
+                ret = block_op_access(op, s.rd_done).val;
+                break;
+            }
+        } else if (op.type == ROP_PSCRIPT) {
+            for (; s.rd_done < op.count; s.rd_done++) {
+                Access a = pscript_op_access(op, s.rd_done);
+                if (!(a.kind & ROP_WRITE)) {
+                    ret = a.val;
+                    break;
+                }
+            }
+            if (s.rd_done < op.count)
+                break;
+        } else if (op.type == ROP_SCRIPT) {
+            if (!s.rd_script.e || s.rd_script_op != s.rd_op ||
+                                  s.rd_done < s.rd_script.base) {
+                s.rd_script = script_cursor(op);
+                s.rd_script_op = s.rd_op;
+            }
+            for (; s.rd_done < op.count; s.rd_done++) {
+                Access a = script_op_access(op, s.rd_script, s.rd_done);
+                if (!(a.kind & ROP_WRITE)) {
+                    ret = a.val;
+                    break;
+                }
+            }
+            if (s.rd_done < op.count)
+                break;
+        } else if (!(op.kind & ROP_WRITE)) {
+            ret = (s.rd_done + 1 == op.count) ? op.last : op.val;
+            break;
+        }
+    }
+    if (s.rd_op < s.size() && ++s.rd_done == s[s.rd_op].count) {
+        s.rd_op++;
+        s.rd_done = 0;
+    }
+    s.log.push_back(Access{adr, ret, kind});
+    return ret;
+}
+
+/* Whether a logged access is the expected one. The value of a logged read was
+ * served from the script rather than observed, and after an extra or missing
+ * read the values served to the following reads are shifted, so that reads
+ * match on their address and width alone. */
+static bool same_access(const Access &a, const volatile void *adr, uint64_t val,
+                        uint8_t kind) {
+    return a.adr == adr && a.kind == kind &&
+           (!(kind & ROP_WRITE) || a.val == val);
+}
+
+size_t match_op(const std::vector<Access> &log, const ROp &op, size_t j) {
+    const Access *a = log.data() + j;
+    size_t n = log.size() - j;
+    size_t k = 0;
+    if (n > op.count)
+        n = op.count;
+    if (op.type == ROP_GROUP) {
+        const RegGroup &g = *(const RegGroup*) op.ext;
+        std::vector<uint32_t> left(g.ops.size());
+        uint64_t pending = 0;
+        for (size_t i = 0; i < g.ops.size(); i++) {
+            left[i] = g.ops[i].count;
+            pending |= 1ull << i;
+        }
+        for (; k < n; k++) {
+            int i = g.find(pending, left.data(), a[k].adr, a[k].val, a[k].kind);
+            if (i < 0 || (!(a[k].kind & ROP_WRITE) &&
+                          g.value(i, left.data()) != a[k].val))
+                break;
+            if (--left[i] == 0)
+                pending &= ~(1ull << i);
+        }
+    } else if (op.type == ROP_GEN) {
+        /* The values were produced by the generator itself */
+        uint8_t kind = ((const RegGen*) op.ext)->kind;
+        for (; k < n; k++)
+            if (a[k].adr != op.adr || a[k].kind != kind)
+                break;
+    } else if (op.type == ROP_TRACE) {
+        for (; k < n; k++) {
+            Access e = trace_op_access(op, k);
+            if (!same_access(a[k], e.adr, e.val, e.kind))
+                break;
+        }
+    } else if (op.type == ROP_BLOCK) {
+        for (; k < n; k++) {
+            Access e = block_op_access(op, k);
+            if (!same_access(a[k], e.adr, e.val, e.kind))
+                break;
+        }
+    } else if (op.type == ROP_PSCRIPT) {
+        for (; k < n; k++) {
+            Access e = pscript_op_access(op, k);
+            if (!same_access(a[k], e.adr, e.val, e.kind))
+                break;
+        }
+    } else if (op.type == ROP_SCRIPT) {
+        ScriptCursor c = script_cursor(op);
+        for (; k < n; k++) {
+            Access e = script_op_access(op, c, k);
+            if (!same_access(a[k], e.adr, e.val, e.kind))
+                break;
+        }
+    } else {
+        size_t run = n < op.count ? n : op.count - 1;
+        for (; k < run; k++)
+            if (!same_access(a[k], op.adr, op.val, op.kind))
+                break;
+        if (k == op.count - 1 && k < n && same_access(a[k], op.adr, op.last,
+                                                                    op.kind))
+            k++;
+    }
+    return k;
+}
+
+ExpSeq::ExpSeq(RegStream &s, size_t op) : s(s) {
+    size_t total = 0;
+    for (size_t i = op; i < s.size(); i++) {
+        if (s[i].type != ROP_SCRIPT) {
+            Seg g = {i, 0, {nullptr, 0}};
+            segs.push_back(g);
+            ends.push_back(total += s[i].count);
+            continue;
+        }
+        ScriptCursor c = script_cursor(s[i]);
+        for (uint32_t k = 0; k < s[i].count; k = c.base + c.e->count) {
+            script_op_access(s[i], c, k);
+            Seg g = {i, k, c};
+            segs.push_back(g);
+            ends.push_back(total += c.base + c.e->count - k);
+        }
+    }
+}
+
+/* Operation of the expected access e, its index k in this operation, and the
+ * script cursor of its entry */
+const ROp& ExpSeq::find(size_t e, size_t &k, ScriptCursor &c) const {
+    size_t i = std::upper_bound(ends.begin(), ends.end(), e) - ends.begin();
+    k = segs[i].k0 + e - (i ? ends[i - 1] : 0);
+    c = segs[i].script;
+    return s[segs[i].op];
+}
+
+/* Expected access e, of an operation other than ROP_GROUP and ROP_GEN */
+Access ExpSeq::access(size_t e, const ROp *&op) const {
+    size_t k;
+    ScriptCursor c;
+    op = &find(e, k, c);
+    switch (op->type) {
+    case ROP_TRACE: return trace_op_access(*op, k);
+    case ROP_BLOCK: return block_op_access(*op, k);
+    case ROP_SCRIPT: return script_op_access(*op, c, k);
+    case ROP_PSCRIPT: return pscript_op_access(*op, k);
+    default:
+        return Access{op->adr, k + 1 == op->count ? op->last : op->val,
+                                                                op->kind};
+    }
+}
+
+bool ExpSeq::match(size_t e, const Access &a) const {
+    const ROp *p;
+    Access x = access(e, p);
+    const ROp &op = *p;
+    if (op.type == ROP_GROUP) {
+        /* Any member will do, the order of the group is not known, but a
+         * write must be of one of the values of its member */
+        const RegGroup &g = *(const RegGroup*) op.ext;
+        for (size_t i = 0; i < g.ops.size(); i++) {
+            const ROp &m = g.ops[i];
+            if (same_access(a, m.adr, m.val, m.kind) ||
+                same_access(a, m.adr, m.last, m.kind))
+                return true;
+        }
+        return false;
+    }
+    if (op.type == ROP_GEN)
+        return a.adr == op.adr && a.kind == ((const RegGen*) op.ext)->kind;
+    return same_access(a, x.adr, x.val, x.kind);
+}
+
+/* Value of an access, cut to the width of its register, such as the all ones
+ * of a failed read */
+static unsigned long long access_val(const Access &a) {
+    int bits = 8 * (a.kind & ~ROP_WRITE);
+    return bits < 64 ? a.val & ((1ull << bits) - 1) : a.val;
+}
+
+static void print_access(FILE *out, const char *what, const Access &a) {
+    regtest_fprint(out, "%s %s of 0x%0*llx at address %p\n", what,
+            (a.kind & ROP_WRITE) ? "write" : "read",
+            (int) (2 * (a.kind & ~ROP_WRITE)), access_val(a), a.adr);
+}
+
+void ExpSeq::print(FILE *out, const char *what, size_t e) const {
+    const ROp *op;
+    Access x = access(e, op);
+    if (op->type == ROP_GROUP)
+        regtest_fprint(out, "%s access of an unordered group of %zu operations\n",
+                what, ((const RegGroup*) op->ext)->ops.size());
+    else if (op->type == ROP_GEN)
+        regtest_fprint(out, "%s generated read at address %p\n", what, op->adr);
+    else
+        print_access(out, what, x);
+}
+
+RegDiff::RegDiff(const ExpSeq &exp, const std::vector<Access> &log, size_t j,
+                 FILE *out) : missing(0), extra(0), exp(exp), log(log), b0(j),
+                              out(out), work(0), max_work(1ull << 24) {}
+
+void RegDiff::edit(bool del, size_t a, size_t b) {
+    if (missing + extra < SHOWN) {
+        char what[48];
+        if (del) {
+            snprintf(what, sizeof what, "  - before access #%llu, expected",
+                     (unsigned long long) (exp.s.log_base + b0 + b));
+            exp.print(out, what, a);
+        } else {
+            snprintf(what, sizeof what, "  + access #%llu, unexpected",
+                     (unsigned long long) (exp.s.log_base + b0 + b));
+            print_access(out, what, log[b0 + b]);
+        }
+    } else if (missing + extra == SHOWN) {
+        regtest_fprint(out, "  ...\n");
+    }
+    if (del)
+        missing++;
+    else
+        extra++;
+}
+
+/* Find the middle snake of the edit graph of [a0, a1) and [b0, b1), both
+ * without common prefix and suffix: snk receives its start and end points */
+bool RegDiff::snake(size_t a0, size_t a1, size_t b0, size_t b1,
+                                                     size_t snk[4]) {
+    ptrdiff_t n = a1 - a0, m = b1 - b0, delta = n - m;
+    ptrdiff_t dmax = (n + m + 1) / 2, off = dmax + 1;
+    bool odd = delta & 1;
+    ptrdiff_t *f = vf.data() + off, *r = vb.data() + off;
+    f[1] = 0;
+    r[1] = 0;
+    for (ptrdiff_t d = 0; d <= dmax; d++) {
+        if (work > max_work)
+            return false;
+        for (ptrdiff_t k = -d; k <= d; k += 2) {
+            ptrdiff_t x = (k == -d || (k != d && f[k - 1] < f[k + 1])) ?
+                          f[k + 1] : f[k - 1] + 1;
+            ptrdiff_t y = x - k, x0 = x, y0 = y;
+            while (x < n && y < m && eq(a0 + x, b0 + y))
+                x++, y++;
+            f[k] = x;
+            ptrdiff_t kr = delta - k;
+            if (odd && kr >= -(d - 1) && kr <= d - 1 && x + r[kr] >= n) {
+                snk[0] = a0 + x0, snk[1] = b0 + y0;
+                snk[2] = a0 + x, snk[3] = b0 + y;
+                return true;
+            }
+        }
+        for (ptrdiff_t k = -d; k <= d; k += 2) {
+            ptrdiff_t x = (k == -d || (k != d && r[k - 1] < r[k + 1])) ?
+                          r[k + 1] : r[k - 1] + 1;
+            ptrdiff_t y = x - k, x0 = x, y0 = y;
+            while (x < n && y < m && eq(a1 - x - 1, b0 + m - y - 1))
+                x++, y++;
+            r[k] = x;
+            ptrdiff_t kf = delta - k;
+            if (!odd && kf >= -d && kf <= d && f[kf] + x >= n) {
+                snk[0] = a1 - x, snk[1] = b1 - y;
+                snk[2] = a1 - x0, snk[3] = b1 - y0;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void RegDiff::diff(size_t a0, size_t a1, size_t b0, size_t b1) {
+    while (a0 < a1 && b0 < b1 && eq(a0, b0))
+        a0++, b0++;
+    while (a0 < a1 && b0 < b1 && eq(a1 - 1, b1 - 1))
+        a1--, b1--;
+    if (a0 == a1 || b0 == b1) {
+        for (; a0 < a1; a0++)
+            edit(true, a0, b0);
+        for (; b0 < b1; b0++)
+            edit(false, a0, b0);
+        return;
+    }
+    size_t snk[4];
+    if (!snake(a0, a1, b0, b1, snk)) {
+        work = max_work + 1;
+        return;
+    }
+    diff(a0, snk[0], b0, snk[1]);
+    if (work <= max_work)
+        diff(snk[2], a1, snk[3], b1);
+}
+
+/* Print the edit script, return false if the traces diverge too much */
+bool RegDiff::run() {
+    size_t n = exp.size(), m = log.size() - b0;
+    vf.resize(n + m + 4);
+    vb.resize(n + m + 4);
+    regtest_fprint(out, "\nDifferences with the expected operations:\n");
+    diff(0, n, 0, m);
+    if (work > max_work) {
+        regtest_fprint(out, "  (too many differences, giving up)\n");
+        return false;
+    }
+    regtest_fprint(out, "%zu expected operation(s) missing, %zu unexpected "
+                 "access(es)\n", missing, extra);
+    return true;
+}
+
+thread_local bool regcheck_resume = false;
+
+#if REGTEST_FAIL == REGTEST_FAIL_CONTINUE
+/* The logs start when a failure is let through, so they remember how many
+ * accesses came before: all those checked, but the failing one of s, which is
+ * the first one logged. */
+static void log_start(RegStream &s, RegStream &failing) {
+    s.log_base = s.checked - (&s == &failing);
+}
+#endif
+
+/* Let a failure of stream s through, by switching to REGTEST_DEFERRED mode */
+static bool fail_deferred(RegStream &s) {
+#if REGTEST_FAIL == REGTEST_FAIL_CONTINUE
+    log_start(ropq, s);
+    for (size_t i = 0; i < regstreams.size(); i++)
+        log_start(*regstreams[i].stream, s);
+    regmode = REGTEST_DEFERRED;
+    regcheck_resume = true;
+    return true;
+#else
+    (void) s;
+    return false;
+#endif
+}
+
+int deferred_rest(RegStream &s) {
+    size_t len = s.log.size(), j = 0;
+    size_t nops = s.size();
+    char msg[160] = "";
+    for (size_t i = 0; i < nops && !msg[0]; i++) {
+        if (s[i].type == ROP_IRQ) {
+            snprintf(msg, sizeof msg,
+                     "Interrupts are only run in REGTEST_CHECK mode.");
+            break;
+        }
+        size_t k = match_op(s.log, s[i], j);
+        j += k;
+        if (k == s[i].count)
+            continue;
+#if REGTEST_FAIL == REGTEST_FAIL_CONTINUE
+        RegDiff(ExpSeq(s, i), s.log, j - k, stdout).run();
+#endif
+        if (j == len) {
+            snprintf(msg, sizeof msg,
+                     "Expected register operation(s) did not occur.");
+        } else {
+            const Access &a = s.log[j];
+            snprintf(msg, sizeof msg,
+                     "Unexpected %s of 0x%0*llx at address %p (access #%llu)",
+                     (a.kind & ROP_WRITE) ? "write" : "read",
+                     (int) (2 * (a.kind & ~ROP_WRITE)), access_val(a), a.adr,
+                     (unsigned long long) (s.log_base + j));
+        }
+    }
+    if (!msg[0] && j < len)
+        snprintf(msg, sizeof msg, "Unexpected register operation(s) after the "
+                 "script ended (access #%llu at address %p)",
+                 (unsigned long long) (s.log_base + j), s.log[j].adr);
+    s.clear();
+    s.log.clear();
+    s.checked = 0;
+    s.log_base = 0;
+    s.rd_op = 0;
+    s.rd_done = 0;
+    s.rd_script.e = nullptr;
+    if (msg[0]) {
+        regtest_fail("%s", msg);
+        return 1;
+    }
+    return 0;
+}
+
+thread_local unsigned reghooks = 0;
+
+static void reghook_set(unsigned hook, bool on) {
+    reghooks = on ? (reghooks | hook) : (reghooks & ~hook);
+}
+
+thread_local std::vector<RegStat> regstats;
+thread_local size_t regstats_used = 0;
+
+static size_t regstat_hash(const volatile void *adr) {
+    uint64_t h = (uintptr_t) adr * 0x9e3779b97f4a7c15ull;
+    return (size_t) (h ^ (h >> 32));
+}
+
+RegStat& regstat_slot(const volatile void *adr) {
+    if (2 * (regstats_used + 1) > regstats.size()) {
+        std::vector<RegStat> old(regstats.empty() ? 64 : 2 * regstats.size());
+        old.swap(regstats);
+        regstats_used = 0;
+        for (size_t i = 0; i < old.size(); i++)
+            if (old[i].adr)
+                regstat_slot(old[i].adr) = old[i];
+    }
+    size_t mask = regstats.size() - 1;
+    size_t i = regstat_hash(adr) & mask;
+    while (regstats[i].adr && regstats[i].adr != adr)
+        i = (i + 1) & mask;
+    if (!regstats[i].adr) {
+        regstats[i].adr = adr;
+        regstats_used++;
+    }
+    return regstats[i];
+}
+
+void regstat_count(const volatile void *adr, uint8_t kind) {
+    RegStat &st = regstat_slot(adr);
+    if (kind & ROP_WRITE)
+        st.writes++;
+    else
+        st.reads++;
+}
+
+void regstats_enable(bool on) {
+    reghook_set(HOOK_STATS, on);
+}
+
+void regstats_clear() {
+    regstats.clear();
+    regstats_used = 0;
+}
+
+static bool regstat_hotter(const RegStat &a, const RegStat &b) {
+    return a.reads + a.writes > b.reads + b.writes;
+}
+
+void regstats_report(FILE *out) {
+    std::vector<RegStat> hot;
+    for (size_t i = 0; i < regstats.size(); i++)
+        if (regstats[i].adr)
+            hot.push_back(regstats[i]);
+    std::sort(hot.begin(), hot.end(), regstat_hotter);
+    regtest_fprint(out, "\n%-18s %12s %12s %12s\n", "address", "reads", "writes",
+                                                                   "total");
+    for (size_t i = 0; i < hot.size(); i++)
+        regtest_fprint(out, "%-18p %12llu %12llu %12llu\n", hot[i].adr,
+                (unsigned long long) hot[i].reads,
+                (unsigned long long) hot[i].writes,
+                (unsigned long long) (hot[i].reads + hot[i].writes));
+}
+
+thread_local std::vector<BusRange> bus_ranges;
+thread_local BusRange *bus_last = nullptr;
+thread_local uint32_t bus_default_read = 0;
+thread_local uint32_t bus_default_write = 0;
+thread_local uint64_t bus_clock = 0;
+thread_local uint64_t bus_budget = 0;
+
+void bus_cost(const volatile void *adr, size_t size, uint32_t read_cycles,
+                                                     uint32_t write_cycles) {
+    BusRange r = {(uintptr_t) adr, (uintptr_t) adr + size, read_cycles,
+                                                           write_cycles};
+    if (!range_insert(bus_ranges, bus_last, r))
+        regtest_fail("The bus cost range at %p overlaps another range.", adr);
+    reghook_set(HOOK_BUS, true);
+}
+
+void bus_cost_default(uint32_t read_cycles, uint32_t write_cycles) {
+    bus_default_read = read_cycles;
+    bus_default_write = write_cycles;
+    reghook_set(HOOK_BUS, true);
+}
+
+void expect_bus_budget(uint64_t cycles) {
+    bus_budget = cycles;
+}
+
+uint64_t bus_time() {
+    return bus_clock;
+}
+
+void bus_access(const volatile void *adr, uint8_t kind) {
+    const BusRange *r = range_find(bus_ranges, bus_last, (uintptr_t) adr);
+    if (kind & ROP_WRITE)
+        bus_clock += r ? r->write_cycles : bus_default_write;
+    else
+        bus_clock += r ? r->read_cycles : bus_default_read;
+}
+
+int bus_rest() {
+    int ret = 0;
+    regtest_print("\nBus time: %llu cycles\n", (unsigned long long) bus_clock);
+    if (bus_budget && bus_clock > bus_budget) {
+        regtest_print("\nBus time exceeds the budget of %llu cycles.\n",
+                                           (unsigned long long) bus_budget);
+        ret = 1;
+    }
+    bus_clock = 0;
+    bus_budget = 0;
+    return ret;
+}
+
+thread_local std::vector<BudgetRange> budget_ranges;
+thread_local BudgetRange *budget_last = nullptr;
+thread_local uint64_t budget_limit = 0;
+thread_local uint64_t budget_used = 0;
+thread_local Access history[HISTORY_SIZE];
+
+void expect_access_budget(uint64_t accesses) {
+    budget_limit = accesses;
+    reghook_set(HOOK_BUDGET, true);
+}
+
+void expect_access_budget(const volatile void *adr, size_t size,
+                                                    uint64_t accesses) {
+    BudgetRange r = {(uintptr_t) adr, (uintptr_t) adr + size, accesses, 0};
+    if (!range_insert(budget_ranges, budget_last, r))
+        regtest_fail("The access budget range at %p overlaps another range.",
+                     adr);
+    reghook_set(HOOK_BUDGET, true);
+}
+
+void access_history_report(FILE *out) {
+    uint64_t n = std::min<uint64_t>(budget_used, HISTORY_SIZE);
+    regtest_fprint(out, "\nLast %llu register accesses:\n", (unsigned long long) n);
+    for (uint64_t i = budget_used - n; i < budget_used; i++) {
+        const Access &a = history[i % HISTORY_SIZE];
+        regtest_fprint(out, "    #%-10llu %-5s %u bytes at %p\n",
+                (unsigned long long) i, (a.kind & ROP_WRITE) ? "write" : "read",
+                a.kind & ~ROP_WRITE, a.adr);
+    }
+}
+
+REGTEST_COLD
+void budget_exceeded(const volatile void *adr, uint64_t limit) {
+    access_history_report();
+    regtest_fail("Access budget of %llu exceeded at address %p",
+                 (unsigned long long) limit, adr);
+#if REGTEST_FAIL == REGTEST_FAIL_CONTINUE
+    regtest_flush();
+    abort();
+#endif
+}
+
+void budget_access(const volatile void *adr, uint8_t kind) {
+    history[budget_used % HISTORY_SIZE] = Access{adr, 0, kind};
+    if (++budget_used > budget_limit && budget_limit)
+        budget_exceeded(adr, budget_limit);
+    BudgetRange *r = budget_ranges.empty() ? nullptr :
+                     range_find(budget_ranges, budget_last, (uintptr_t) adr);
+    if (r && ++r->used > r->limit)
+        budget_exceeded(adr, r->limit);
+}
+
+void budget_rest() {
+    budget_used = 0;
+    for (size_t i = 0; i < budget_ranges.size(); i++)
+        budget_ranges[i].used = 0;
+}
+
+static const char *const pattern_names[] = {
+    "read after write", "repeated write", "polling, no backoff",
+    "mergeable writes"
+};
+
+thread_local std::vector<RegFinding> findings;
+thread_local Access analyze_prev;
+thread_local uint64_t analyze_seq = 0;
+thread_local uint64_t analyze_run = 0;
+
+void regtest_analyze_enable(bool on) {
+    reghook_set(HOOK_ANALYZE, on);
+}
+
+void finding_add(int pattern, const volatile void *adr, uint64_t first,
+                                                        uint64_t accesses) {
+    for (size_t i = 0; i < findings.size(); i++) {
+        RegFinding &f = findings[i];
+        if (f.pattern == pattern && f.adr == adr) {
+            f.count++;
+            f.accesses += accesses;
+            return;
+        }
+    }
+    RegFinding f = {pattern, adr, 1, first, accesses};
+    findings.push_back(f);
+}
+
+/* End the current run of reads of one register */
+static void analyze_run_end() {
+    if (analyze_run >= BUSY_POLL_READS)
+        finding_add(PAT_BUSY_POLL, analyze_prev.adr, analyze_seq - analyze_run,
+                                                     analyze_run);
+    analyze_run = 0;
+}
+
+void analyze_access(const volatile void *adr, uint64_t v, uint8_t kind) {
+    const Access &p = analyze_prev;
+    bool write = kind & ROP_WRITE;
+    unsigned width = kind & ~ROP_WRITE;
+    if (analyze_seq && (p.kind & ROP_WRITE)) {
+        if (!write && p.adr == adr)
+            finding_add(PAT_READ_AFTER_WRITE, adr, analyze_seq - 1, 2);
+        else if (write && p.adr == adr && p.kind == kind && p.val == v)
+            finding_add(PAT_SAME_WRITE, adr, analyze_seq - 1, 2);
+        else if (write && p.kind == kind && width < 8 &&
+                 (uintptr_t) adr == (uintptr_t) p.adr + width &&
+                 (uintptr_t) p.adr % (2 * width) == 0)
+            finding_add(PAT_MERGEABLE_WRITES, p.adr, analyze_seq - 1, 2);
+    }
+    if (!write && analyze_run && p.adr == adr && p.kind == kind) {
+        analyze_run++;
+    } else {
+        analyze_run_end();
+        analyze_run = !write;
+    }
+    analyze_prev = Access{adr, v, kind};
+    analyze_seq++;
+}
+
+static bool finding_more(const RegFinding &a, const RegFinding &b) {
+    return a.accesses > b.accesses;
+}
+
+void analysis_report(FILE *out) {
+    analyze_run_end();
+    std::vector<RegFinding> sorted(findings);
+    std::sort(sorted.begin(), sorted.end(), finding_more);
+    regtest_fprint(out, "\n%-20s %-18s %10s %12s %12s\n", "pattern", "address",
+                                          "count", "accesses", "first at");
+    for (size_t i = 0; i < sorted.size(); i++)
+        regtest_fprint(out, "%-20s %-18p %10llu %12llu %12llu\n",
+                pattern_names[sorted[i].pattern], sorted[i].adr,
+                (unsigned long long) sorted[i].count,
+                (unsigned long long) sorted[i].accesses,
+                (unsigned long long) sorted[i].first);
+}
+
+void analysis_clear() {
+    findings.clear();
+    analyze_seq = 0;
+    analyze_run = 0;
+}
+
+/* Analyze the log from a clean state, and then put back the live findings,
+ * which the analysis of the accesses of the test goes on with. */
+void analyze_log(const std::vector<Access> &log, FILE *out) {
+    std::vector<RegFinding> live;
+    live.swap(findings);
+    Access prev = analyze_prev;
+    uint64_t seq = analyze_seq, run = analyze_run;
+    analyze_seq = 0;
+    analyze_run = 0;
+    for (size_t i = 0; i < log.size(); i++)
+        analyze_access(log[i].adr, (log[i].kind & ROP_WRITE) ? log[i].val : 0,
+                                                               log[i].kind);
+    analysis_report(out);
+    findings.swap(live);
+    analyze_prev = prev;
+    analyze_seq = seq;
+    analyze_run = run;
+}
+
+void access_hooks(const volatile void *adr, uint64_t v, uint8_t kind) {
+    if (reghooks & HOOK_STATS)
+        regstat_count(adr, kind);
+    if (reghooks & HOOK_BUS)
+        bus_access(adr, kind);
+    if (reghooks & HOOK_BUDGET)
+        budget_access(adr, kind);
+    if (reghooks & HOOK_ANALYZE)
+        analyze_access(adr, v, kind);
+}
+
+thread_local RegSink *regsink = nullptr;
+thread_local uint64_t reglog_seq = 0;
+
+void regtest_set_sink(RegSink *sink) {
+    regsink = sink;
+}
+
+void regtest_write(const char *s, size_t len) {
+    if (regsink)
+        regsink->text(s, len);
+    else
+        fwrite(s, 1, len, stdout);
+}
+
+static void sink_vprint(const char *fmt, va_list ap) {
+    char buf[512];
+    va_list aq;
+    va_copy(aq, ap);
+    int n = vsnprintf(buf, sizeof buf, fmt, ap);
+    if (n >= (int) sizeof buf) {
+        std::vector<char> big(n + 1);
+        vsnprintf(big.data(), big.size(), fmt, aq);
+        regtest_write(big.data(), n);
+    } else if (n > 0) {
+        regtest_write(buf, n);
+    }
+    va_end(aq);
+}
+
+void regtest_print(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (regsink)
+        sink_vprint(fmt, ap);
+    else
+        vprintf(fmt, ap);
+    va_end(ap);
+}
+
+void regtest_fprint(FILE *out, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (regsink && out == stdout)
+        sink_vprint(fmt, ap);
+    else
+        vfprintf(out, fmt, ap);
+    va_end(ap);
+}
+
+void regtest_flush() {
+    if (regsink)
+        regsink->flush();
+    fflush(stdout);
+}
+
+/* Access logs go to stdout without a sink */
+static RegSink& log_sink() {
+    static RegFileSink out(stdout);
+    return regsink ? *regsink : out;
+}
+
+void regtest_log_accesses(bool on) {
+    reghook_set(HOOK_LOG, on);
+}
+
+void log_access(const volatile void *adr, uint64_t v, uint8_t kind) {
+    log_sink().access(reglog_seq++, Access{adr, v, kind});
+}
+
+RegFileSink::RegFileSink(const char *path) : f(fopen(path, "w")), own(true) {
+    if (!f) {
+        printf("\nCannot create the log %s\n", path);
+        f = stdout;
+        own = false;
+    }
+}
+
+RegFileSink::~RegFileSink() {
+    if (own)
+        fclose(f);
+    else
+        fflush(f);
+}
+
+void RegFileSink::text(const char *s, size_t len) {
+    fwrite(s, 1, len, f);
+}
+
+void RegFileSink::access(uint64_t seq, const Access &a) {
+    int width = 2 * (a.kind & ~ROP_WRITE);
+    fprintf(f, "#%-10llu %-5s 0x%0*llx at %p\n", (unsigned long long) seq,
+            (a.kind & ROP_WRITE) ? "write" : "read", width,
+            (unsigned long long) a.val, a.adr);
+}
+
+void RegFileSink::flush() {
+    fflush(f);
+}
+
+RegJsonSink::~RegJsonSink() {
+    message();
+}
+
+void RegJsonSink::message() {
+    if (line.empty())
+        return;
+    fputs("{\"msg\":\"", f);
+    for (size_t i = 0; i < line.size(); i++) {
+        unsigned char ch = line[i];
+        if (ch == '"' || ch == '\\')
+            fprintf(f, "\\%c", ch);
+        else if (ch < 0x20)
+            fprintf(f, "\\u%04x", ch);
+        else
+            fputc(ch, f);
+    }
+    fputs("\"}\n", f);
+    line.clear();
+}
+
+void RegJsonSink::text(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\n')
+            message();
+        else
+            line.push_back(s[i]);
+    }
+}
+
+void RegJsonSink::access(uint64_t seq, const Access &a) {
+    fprintf(f, "{\"seq\":%llu,\"op\":\"%s\",\"size\":%u,\"adr\":\"%p\","
+               "\"val\":\"0x%llx\"}\n", (unsigned long long) seq,
+            (a.kind & ROP_WRITE) ? "write" : "read", a.kind & ~ROP_WRITE,
+            a.adr, (unsigned long long) a.val);
+}
+
+/* Forks since the start of the process. This one is not thread local: it
+ * tells the asynchronous sinks that they lost their drain thread. */
+static unsigned regforks = 0;
+
+static void fork_child() {
+    regforks++;
+}
+
+static std::atomic<uint64_t> regsink_ids(0);
+
+enum { LOG_TEXT = 1, LOG_ACCESS = 2 };
+
+struct LogAccess {
+    uint64_t seq;
+    Access a;
+};
+
+struct RegAsyncSink::Thread {
+    std::mutex lock;                     // guards rings
+    std::thread drain;
+};
+
+RegAsyncSink::RegAsyncSink(RegSink &out, size_t size)
+    : out(out), size(64), id(++regsink_ids), forks(regforks), stop(false),
+      flush_req(0), flush_done(0) {
+    static int atfork = pthread_atfork(nullptr, nullptr, fork_child);
+    (void) atfork;
+    while (this->size < size)
+        this->size *= 2;
+    thread = new Thread;
+    thread->drain = std::thread(&RegAsyncSink::drain, this);
+}
+
+RegAsyncSink::~RegAsyncSink() {
+    if (forks != regforks)
+        return;
+    stop = true;
+    thread->drain.join();
+    delete thread;
+    for (size_t i = 0; i < rings.size(); i++)
+        delete rings[i];
+}
+
+/* Ring of the calling thread, created once per thread and sink, and found
+ * without locking in the list of the rings of the thread. Sink ids are never
+ * reused, so the entries of destroyed sinks just never match. */
+RegAsyncSink::Ring& RegAsyncSink::ring() {
+    static thread_local std::vector<std::pair<uint64_t, Ring*> > mine;
+    static thread_local size_t last = 0;
+    if (REGTEST_LIKELY(last < mine.size() && mine[last].first == id))
+        return *mine[last].second;
+    for (last = 0; last < mine.size(); last++)
+        if (mine[last].first == id)
+            return *mine[last].second;
+    std::lock_guard<std::mutex> g(thread->lock);
+    Ring *r = new Ring(size);
+    rings.push_back(r);
+    mine.push_back(std::make_pair(id, r));
+    return *r;
+}
+
+static void ring_put(std::vector<char> &buf, size_t at, const void *p,
+                                                          size_t len) {
+    size_t mask = buf.size() - 1, i = at & mask;
+    size_t n = std::min(len, buf.size() - i);
+    memcpy(&buf[i], p, n);
+    memcpy(&buf[0], (const char*) p + n, len - n);
+}
+
+static void ring_get(const std::vector<char> &buf, size_t at, void *p,
+                                                          size_t len) {
+    size_t mask = buf.size() - 1, i = at & mask;
+    size_t n = std::min(len, buf.size() - i);
+    memcpy(p, &buf[i], n);
+    memcpy((char*) p + n, &buf[0], len - n);
+}
+
+/* Records are a type and a length on 8 bytes, followed by the payload padded
+ * to 8 bytes, so that headers never wrap around the end of the ring. */
+void RegAsyncSink::push(uint32_t type, const void *p, size_t len) {
+    Ring &r = ring();
+    size_t need = 8 + ((len + 7) & ~(size_t) 7);
+    size_t t = r.tail.load(std::memory_order_relaxed);
+    while (r.buf.size() - (t - r.head.load(std::memory_order_acquire)) < need)
+        sched_yield();
+    uint32_t hdr[2] = {type, (uint32_t) len};
+    size_t i = t & (r.buf.size() - 1);
+    if (REGTEST_LIKELY(i + need <= r.buf.size())) {
+        memcpy(&r.buf[i], hdr, sizeof hdr);
+        memcpy(&r.buf[i + 8], p, len);
+    } else {
+        ring_put(r.buf, t, hdr, sizeof hdr);
+        ring_put(r.buf, t + 8, p, len);
+    }
+    r.tail.store(t + need, std::memory_order_release);
+}
+
+void RegAsyncSink::text(const char *s, size_t len) {
+    if (forks != regforks)
+        return out.text(s, len);
+    size_t max = size / 2 - 8;
+    for (size_t i = 0; i < len; i += max)
+        push(LOG_TEXT, s + i, std::min(max, len - i));
+}
+
+void RegAsyncSink::access(uint64_t seq, const Access &a) {
+    if (forks != regforks)
+        return out.access(seq, a);
+    LogAccess rec = {seq, a};
+    push(LOG_ACCESS, &rec, sizeof rec);
+}
+
+void RegAsyncSink::flush() {
+    if (forks != regforks)
+        return out.flush();
+    uint64_t t = flush_req.fetch_add(1) + 1;
+    while (flush_done.load(std::memory_order_acquire) < t)
+        sched_yield();
+}
+
+/* Forward whatever the rings hold, return whether there was anything */
+bool RegAsyncSink::drain_rings() {
+    std::lock_guard<std::mutex> g(thread->lock);
+    bool any = false;
+    for (size_t i = 0; i < rings.size(); i++) {
+        Ring &r = *rings[i];
+        size_t h = r.head.load(std::memory_order_relaxed);
+        size_t t = r.tail.load(std::memory_order_acquire);
+        while (h != t) {
+            uint32_t hdr[2];
+            ring_get(r.buf, h, hdr, sizeof hdr);
+            tmp.resize(hdr[1]);
+            ring_get(r.buf, h + 8, tmp.data(), hdr[1]);
+            h += 8 + ((hdr[1] + 7) & ~(size_t) 7);
+            r.head.store(h, std::memory_order_release);
+            if (hdr[0] == LOG_TEXT) {
+                out.text(tmp.data(), tmp.size());
+            } else {
+                LogAccess rec;
+                memcpy(&rec, tmp.data(), sizeof rec);
+                out.access(rec.seq, rec.a);
+            }
+            any = true;
+        }
+    }
+    return any;
+}
+
+/* Body of the background thread, which polls the rings so that producers
+ * never have to wake it up, backing off up to a millisecond when idle */
+void RegAsyncSink::drain() {
+    unsigned idle = 0;
+    for (;;) {
+        uint64_t req = flush_req.load(std::memory_order_acquire);
+        bool stopping = stop.load(std::memory_order_acquire);
+        bool any = drain_rings();
+        if (req != flush_done.load(std::memory_order_relaxed)) {
+            out.flush();
+            flush_done.store(req, std::memory_order_release);
+        }
+        if (stopping && !any)
+            break;
+        if (any) {
+            idle = 0;
+            continue;
+        }
+        if (idle < 5)
+            idle++;
+        struct timespec ts = {0, 31250L << idle};
+        nanosleep(&ts, nullptr);
+    }
+    out.flush();
+}
+
+thread_local RegShm *regshm_out = nullptr;
+
+void rop_queue(const ROp &op) {
+    if (regshm_out) {
+        shm_push(regshm_out, op);
+    } else if (!reggroup_open) {
+        reg_route(op.adr).push(op);
+    } else if (op.type != ROP_SINGLE) {
+        regtest_fail("Only single operations may be part of unordered groups.");
+    } else if (reggroup_open->ops.size() == RegGroup::MAX) {
+        regtest_fail("Too many operations in an unordered group.");
+    } else {
+        reggroup_open->add(op);
+    }
+}
+
+void expect_group_begin() {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    if (reggroup_open) {
+        reggroup_depth++;
+        return;
+    }
+    if (regshm_out) {
+        regtest_fail("Unordered groups may not be sent to another process.");
+        return;
+    }
+    reggroup_open = new RegGroup;
+    reggroups.push_back(reggroup_open);
+}
+
+void expect_group_end() {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    if (reggroup_depth) {
+        reggroup_depth--;
+        return;
+    }
+    RegGroup *g = reggroup_open;
+    reggroup_open = nullptr;
+    if (g && g->total)
+        reg_route(g->ops[0].adr).emplace(ROP_GROUP, g->ops[0].adr, g,
+                                                                  g->total);
+}
+
+void expect_script(const volatile void *base, const SOp *script, size_t n) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    uint64_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!script[i].count) {
+            regtest_fail("Entry %zu of the script has no access.", i);
+            return;
+        }
+        count += script[i].count;
+    }
+    if (count > UINT32_MAX) {
+        regtest_fail("Scripts are limited to %u accesses.", UINT32_MAX);
+        return;
+    }
+    if (count)
+        rop_queue(ROp(ROP_SCRIPT, base, script, count));
+}
+
+void expect_script(const POp *script, size_t n) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    for (size_t i = 0; i < n; i++) {
+        if (!periph_bases[script[i].periph]) {
+            regtest_fail("Peripheral %u of the script is not bound.",
+                         script[i].periph);
+            return;
+        }
+    }
+    if (n > UINT32_MAX) {
+        regtest_fail("Scripts are limited to %u accesses.", UINT32_MAX);
+        return;
+    }
+    /* The peripherals may belong to different streams: each run of entries
+     * of the same stream goes to that stream */
+    for (size_t i = 0, j; i < n; i = j) {
+        const volatile void *adr = pop_adr(script[i]);
+        RegStream *s = &reg_route(adr);
+        for (j = i + 1; j < n && &reg_route(pop_adr(script[j])) == s; j++) {}
+        rop_queue(ROp(ROP_PSCRIPT, adr, script + i, j - i));
+    }
+}
+
+struct RegChannel::Sleep {
+    std::mutex lock;
+    std::condition_variable cv;
+};
+
+RegChannel::RegChannel(size_t capacity) : head(0), tail(0), closed(false),
+                                          sleepers(0), sleep(new Sleep) {
+    size_t cap = 16;
+    while (cap < capacity)
+        cap *= 2;
+    buf.resize(cap);
+    mask = cap - 1;
+}
+
+RegChannel::~RegChannel() {
+    delete sleep;
+}
+
+template <typename Ready>
+void RegChannel::wait(Ready ready) {
+    for (int i = 0; i < SPINS; i++)
+        if (ready())
+            return;
+    sleepers++;
+    std::unique_lock<std::mutex> lk(sleep->lock);
+    sleep->cv.wait(lk, ready);
+    lk.unlock();
+    sleepers--;
+}
+
+void RegChannel::wake() {
+    if (sleepers.load()) {
+        std::lock_guard<std::mutex> lk(sleep->lock);
+        sleep->cv.notify_all();
+    }
+}
+
+void RegChannel::push(const ROp &op) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == buf.size())
+        wait([&]() { return t - head.load() < buf.size(); });
+    buf[t & mask] = op;
+    tail.store(t + 1);
+    wake();
+}
+
+void RegChannel::close() {
+    closed.store(true);
+    wake();
+}
+
+ROp* RegChannel::front() {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+        wait([&]() { return h != tail.load() || closed.load(); });
+        /* The producer closes the channel after its last push */
+        if (h == tail.load())
+            return nullptr;
+    }
+    return &buf[h & mask];
+}
+
+void RegChannel::pop() {
+    head.store(head.load(std::memory_order_relaxed) + 1);
+    wake();
+}
+
+void expect_from_channel(RegChannel &ch, const volatile void *adr) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    rop_queue(ROp(ROP_SOURCE, adr, static_cast<RegSource*>(&ch), 1));
+}
+
+static const char SHM_MAGIC[8] = {'R', 'G', 'T', 'S', 'H', 'M', 0, 0};
+
+int RegShm::map(int fd, const char *path) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(ShmHdr))
+        size = st.st_size;
+    void *p = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                             fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        regtest_print("\nCannot map the shared memory transport %s\n", path);
+        return 1;
+    }
+    hdr = (ShmHdr*) p;
+    snprintf(name, sizeof name, "%s", path);
+    return 0;
+}
+
+int RegShm::create(const char *path, const volatile void *b, size_t capacity) {
+    size_t cap = 16;
+    while (cap < capacity)
+        cap *= 2;
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    size_t len = sizeof(ShmHdr) + cap * (sizeof(ShmOp) + sizeof(TraceRec));
+    if (fd < 0 || ftruncate(fd, len) != 0) {
+        regtest_print("\nCannot create the shared memory transport %s\n", path);
+        if (fd >= 0)
+            ::close(fd);
+        return 1;
+    }
+    if (map(fd, path))
+        return 1;
+    new (hdr) ShmHdr();
+    memcpy(hdr->magic, SHM_MAGIC, sizeof hdr->magic);
+    hdr->version = 1;
+    hdr->capacity = cap;
+    hdr->script_pid.store(getpid());
+    owner = true;
+    base = (uintptr_t) b;
+    exp = (ShmOp*) (hdr + 1);
+    acc = (TraceRec*) (exp + cap);
+    mask = cap - 1;
+    return 0;
+}
+
+int RegShm::open(const char *path, const volatile void *b) {
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0) {
+        regtest_print("\nCannot open the shared memory transport %s\n", path);
+        return 1;
+    }
+    if (map(fd, path))
+        return 1;
+    if (memcmp(hdr->magic, SHM_MAGIC, sizeof hdr->magic) || hdr->version != 1 ||
+        size < sizeof(ShmHdr) + hdr->capacity * (sizeof(ShmOp) +
+                                                 sizeof(TraceRec))) {
+        regtest_print("\n%s is not a regtest shared memory transport\n", path);
+        munmap(hdr, size);
+        hdr = nullptr;
+        return 1;
+    }
+    hdr->tested_pid.store(getpid());
+    base = (uintptr_t) b;
+    exp = (ShmOp*) (hdr + 1);
+    acc = (TraceRec*) (exp + hdr->capacity);
+    mask = hdr->capacity - 1;
+    return 0;
+}
+
+RegShm::~RegShm() {
+    if (!hdr)
+        return;
+    munmap(hdr, size);
+    if (owner)
+        shm_unlink(name);
+}
+
+/* Whether a process is still running: a child of ours which exited stays a
+ * zombie until reaped, so look at it without reaping it. */
+static bool shm_alive(pid_t pid) {
+    siginfo_t si;
+    si.si_pid = 0;
+    if (waitid(P_PID, pid, &si, WEXITED | WNOHANG | WNOWAIT) == 0)
+        return si.si_pid != pid;
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/* Wait until ready() holds: spin first, then yield, then sleep. Return false
+ * if the other process exits in the meantime. */
+template <typename Ready>
+bool RegShm::wait(Ready ready) {
+    for (unsigned i = 0; !ready(); i++) {
+        if (i < 1000)
+            continue;
+        int32_t peer = owner ? hdr->tested_pid.load() : hdr->script_pid.load();
+        if (peer && !shm_alive(peer))
+            return ready();
+        if (i < 2000) {
+            sched_yield();
+        } else {
+            struct timespec ts = {0, 50000};
+            nanosleep(&ts, nullptr);
+        }
+    }
+    return true;
+}
+
+/* Move the logged accesses to our log, as long as there are some */
+void RegShm::drain() {
+    Access a;
+    uint64_t h = hdr->log_head.load(std::memory_order_relaxed);
+    while (h != hdr->log_tail.load(std::memory_order_acquire)) {
+        const TraceRec &rec = acc[h & mask];
+        a.adr = (const volatile void*) (base + rec.adr);
+        a.val = rec.val;
+        a.kind = rec.seq & 0xff;
+        accesses.push_back(a);
+        hdr->log_head.store(++h, std::memory_order_release);
+    }
+}
+
+void RegShm::push(const ROp &op) {
+    if (op.type != ROP_SINGLE) {
+        regtest_fail("Only single operations may be sent to another process.");
+        return;
+    }
+    uint64_t t = hdr->exp_tail.load(std::memory_order_relaxed);
+    /* Keep draining the log meanwhile, the tested process may wait for it */
+    if (t - hdr->exp_head.load(std::memory_order_acquire) > mask &&
+        !wait([&]() { drain(); return t - hdr->exp_head.load() <= mask; })) {
+        regtest_fail("The tested process exited.");
+        return;
+    }
+    ShmOp &o = exp[t & mask];
+    o.adr = (uintptr_t) op.adr - base;
+    o.val = op.val;
+    o.last = op.last;
+    o.count = op.count;
+    o.kind = op.kind;
+    hdr->exp_tail.store(t + 1, std::memory_order_release);
+}
+
+bool RegShm::next_access(Access &a) {
+    while (next == accesses.size()) {
+        if (!wait([&]() { return hdr->log_head.load() != hdr->log_tail.load()
+                                 || hdr->log_closed.load(); }))
+            return false;
+        drain();
+        if (next == accesses.size() && hdr->log_closed.load())
+            return false;
+    }
+    a = accesses[next++];
+    return true;
+}
+
+void RegShm::close(int status) {
+    if (owner) {
+        hdr->exp_closed.store(1);
+    } else {
+        hdr->status.store(status);
+        hdr->log_closed.store(1);
+    }
+}
+
+/* Script side end of test: wait for the tested process to close its log,
+ * which is kept for next_access(), and report its status. */
+int RegShm::rest() {
+    close();
+    bool alive = wait([&]() { drain(); return hdr->log_closed.load() != 0; });
+    drain();
+    if (!alive) {
+        regtest_fail("The tested process exited before the end of the test.");
+        return 1;
+    }
+    if (hdr->status.load()) {
+        regtest_fail("The test failed in the tested process.");
+        return 1;
+    }
+    return 0;
+}
+
+ROp* RegShm::front() {
+    if (has_cur)
+        return &cur;
+    uint64_t h = hdr->exp_head.load(std::memory_order_relaxed);
+    if (h == hdr->exp_tail.load(std::memory_order_acquire) &&
+        (!wait([&]() { return h != hdr->exp_tail.load() ||
+                              hdr->exp_closed.load(); }) ||
+         h == hdr->exp_tail.load()))
+        return nullptr;
+    const ShmOp &o = exp[h & mask];
+    cur = ROp((const volatile void*) (base + o.adr), o.val, o.last, o.count,
+                                                                   o.kind);
+    has_cur = true;
+    return &cur;
+}
+
+void RegShm::pop() {
+    has_cur = false;
+    hdr->exp_head.store(hdr->exp_head.load(std::memory_order_relaxed) + 1,
+                                               std::memory_order_release);
+}
+
+void RegShm::log(const volatile void *adr, uint64_t v, uint8_t kind) {
+    uint64_t t = hdr->log_tail.load(std::memory_order_relaxed);
+    if (t - hdr->log_head.load(std::memory_order_acquire) > mask &&
+        !wait([&]() { return t - hdr->log_head.load() <= mask; }))
+        return;
+    TraceRec &rec = acc[t & mask];
+    rec.adr = (uintptr_t) adr - base;
+    rec.val = v;
+    rec.seq = (seq++ << 8) | kind;
+    hdr->log_tail.store(t + 1, std::memory_order_release);
+}
+
+void shm_push(RegShm *shm, const ROp &op) {
+    shm->push(op);
+}
+
+void expect_to_shm(RegShm &shm) {
+    shm.accesses.clear();
+    shm.next = 0;
+    regshm_out = &shm;
+}
+
+void expect_from_shm(RegShm &shm, const volatile void *adr) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    rop_queue(ROp(ROP_SOURCE, adr, static_cast<RegSource*>(&shm), 1));
+}
+
+thread_local size_t regirqs = 0;
+
+void expect_interrupt(void (*handler)(), const volatile void *adr) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    ROp op(ROP_IRQ, adr, nullptr, 1);
+    op.irq = handler;
+    rop_queue(op);
+    if (!reggroup_open && !regshm_out) {
+        regirqs++;
+        reghook_set(HOOK_IRQ, true);
+    }
+}
+
+/* Expected access at the head of a queue, and removal of this access */
+static Access front_access(RegStream &s) {
+    const ROp &op = s.front().type == ROP_SOURCE ?
+                    *((RegSource*) s.front().ext)->front() : s.front();
+    if (op.type == ROP_TRACE)
+        return trace_op_access(op, 0);
+    if (op.type == ROP_BLOCK)
+        return block_op_access(op, 0);
+    if (op.type == ROP_SCRIPT) {
+        ScriptCursor c = script_cursor(op);
+        return script_op_access(op, c, 0);
+    }
+    if (op.type == ROP_PSCRIPT)
+        return pscript_op_access(op, 0);
+    if (op.type == ROP_GEN) {
+        /* The value is only produced when the read is consumed */
+        Access a = {op.adr, 0, ((const RegGen*) op.ext)->kind};
+        return a;
+    }
+    Access a = {op.adr, op.count == 1 ? op.last : op.val, op.kind};
+    return a;
+}
+
+static void front_consume(RegStream &s) {
+    if (s.front().type == ROP_SOURCE) {
+        RegSource *src = (RegSource*) s.front().ext;
+        if (--src->front()->count == 0)
+            src->pop();
+        return;
+    }
+    ROp &op = s.front();
+    if (op.type == ROP_TRACE)
+        op.ext = (const TraceRec*) op.ext + 1;
+    else if (op.type == ROP_BLOCK)
+        op.ext = (const unsigned char*) op.ext + (op.val & ~ROP_WRITE);
+    else if (op.type == ROP_PSCRIPT)
+        op.ext = (const POp*) op.ext + 1;
+    else if (op.type == ROP_SCRIPT && ++op.val == ((const SOp*) op.ext)->count) {
+        op.ext = (const SOp*) op.ext + 1;
+        op.val = 0;
+    }
+    if (--op.count == 0)
+        s.pop();
+}
+
+/* Wait for the source at the head of a queue to provide an operation, and
+ * remove the sources that are closed: the head of the queue is then an
+ * operation that front_access can take. */
+static void front_resolve(RegStream &s) {
+    while (!s.empty() && s.front().type == ROP_SOURCE &&
+                         !((RegSource*) s.front().ext)->front())
+        s.pop();
+}
+
+/* Run the interrupt handlers the head of a queue has reached. Each is removed
+ * before it runs, so that its own accesses are checked against what follows. */
+static void front_irqs(RegStream &s) {
+    front_resolve(s);
+    while (!s.empty() && s.front().type == ROP_IRQ) {
+        void (*handler)() = s.front().irq;
+        s.pop();
+        if (--regirqs == 0)
+            reghook_set(HOOK_IRQ, false);
+        handler();
+        front_resolve(s);
+    }
+}
+
+static void front_log(RegStream &s, const volatile void *adr, uint64_t v,
+                                                              uint8_t kind) {
+    if (!s.empty() && s.front().type == ROP_SOURCE)
+        ((RegSource*) s.front().ext)->log(adr, v, kind);
+}
+
+int stream_rest(RegStream &s) {
+    if (regmode == REGTEST_DEFERRED)
+        return deferred_rest(s);
+    s.checked = 0;
+    front_resolve(s);
+    if (!s.empty()) {
+        regtest_fail("Expected register operation(s) did not occur.");
+        return 1;
+    }
+    return 0;
+}
+
+thread_local unsigned regcheckpoints = 0;
+
+int expect_rest() {
+#ifdef REGTEST_PASSTHROUGH
+    return 0;
+#endif
+    int ret = 0;
+    if (reghooks & HOOK_STATS) {
+        regstats_report();
+        regstats_clear();
+    }
+    if (reghooks & HOOK_ANALYZE) {
+        analysis_report();
+        analysis_clear();
+    }
+    if ((reghooks & HOOK_BUS) && bus_rest()) {
+        regtest_fail("Bus time budget exceeded.");
+        ret = 1;
+    }
+    if (reghooks & HOOK_BUDGET)
+        budget_rest();
+    if (regshm_out) {
+        ret |= regshm_out->rest();
+        regshm_out = nullptr;
+    }
+    ret |= stream_rest(ropq);
+    bool done = ropq.empty();
+    for (size_t i = 0; i < regstreams.size(); i++) {
+        ret |= stream_rest(*regstreams[i].stream);
+        done = done && regstreams[i].stream->empty();
+    }
+    if (regcheck_resume) {
+        regmode = REGTEST_CHECK;
+        regcheck_resume = false;
+    }
+    if (done && !regcheckpoints) {
+        script_release();
+        regirqs = 0;
+        reghook_set(HOOK_IRQ, false);
+    }
+    /* Report the failures that were let through */
+    if (regfailures)
+        ret = 1;
+    regfailures = 0;
+    return ret;
+}
+
+RegCheckpoint::RegCheckpoint() : irqs(regirqs) {
+    regcheckpoints++;
+    save(ropq);
+    for (size_t i = 0; i < regstreams.size(); i++)
+        save(*regstreams[i].stream);
+}
+
+void RegCheckpoint::save(RegStream &s) {
+    Saved sv;
+    sv.stream = &s;
+    s.save(sv.ops);
+    sv.log = s.log;
+    sv.checked = s.checked;
+    sv.log_base = s.log_base;
+    sv.rd_op = s.rd_op;
+    sv.rd_done = s.rd_done;
+    for (size_t i = 0; i < sv.ops.size(); i++)
+        if (sv.ops[i].type == ROP_GROUP) {
+            RegGroup *g = (RegGroup*) sv.ops[i].ext;
+            groups.push_back(std::make_pair(g, *g));
+        }
+    streams.push_back(std::move(sv));
+}
+
+void RegCheckpoint::restore() {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    for (size_t i = 0; i < streams.size(); i++) {
+        Saved &sv = streams[i];
+        sv.stream->assign(sv.ops);
+        sv.stream->log.assign(sv.log.begin(), sv.log.end());
+        sv.stream->checked = sv.checked;
+        sv.stream->log_base = sv.log_base;
+        sv.stream->rd_op = sv.rd_op;
+        sv.stream->rd_done = sv.rd_done;
+        sv.stream->rd_script.e = nullptr;
+    }
+    for (size_t i = 0; i < groups.size(); i++)
+        *groups[i].first = groups[i].second;
+    regirqs = irqs;
+    reghook_set(HOOK_IRQ, irqs != 0);
+}
+
+std::vector<RegCase>& regtest_cases() {
+    static std::vector<RegCase> cases;
+    return cases;
+}
+
+void regtest_add_case(const char *name, void (*fn)()) {
+    RegCase c = {name, fn};
+    regtest_cases().push_back(c);
+}
+
+/* Run fn() then expect_rest() in a child, return whether it failed */
+static bool case_body(void (*fn)()) {
+    bool failed = false;
+#if REGTEST_FAIL == REGTEST_FAIL_THROW
+    try {
+#endif
+        fn();
+        failed = expect_rest() != 0;
+#if REGTEST_FAIL == REGTEST_FAIL_THROW
+    } catch (const RegFailure &) {
+        failed = true;
+    }
+#endif
+    regtest_flush();
+    return failed;
+}
+
+/* Verdict of a child that did not exit with status 0 */
+static void fail_status(const char *what, int status, unsigned timeout) {
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM && timeout)
+        regtest_print("FAIL %s (timed out after %us)\n", what, timeout);
+    else if (WIFSIGNALED(status))
+        regtest_print("FAIL %s (%s)\n", what, strsignal(WTERMSIG(status)));
+    else
+        regtest_print("FAIL %s\n", what);
+}
+
+static int wait_child(pid_t pid) {
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    return status;
+}
+
+struct RegChild {
+    size_t i;
+    pid_t pid;
+    int fd;
+    std::string out;
+};
+
+/* Run child(i) in a forked child for every i < count, "jobs" at a time, with
+ * their output going to a pipe a line at a time, so that none is lost when a
+ * failure kills them. The children send plain text, which the parent passes
+ * on to its own sink. report() gets each child, with its output, once the
+ * pipe reaches its end and the child is reaped. Return the number of failed
+ * children, as told by report(). */
+template <typename C, typename R>
+static int fork_children(size_t count, unsigned jobs, C child, R report) {
+    if (!jobs) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = n > 0 ? n : 1;
+    }
+    std::vector<RegChild> running;
+    std::vector<struct pollfd> fds;
+    size_t next = 0;
+    int failed = 0;
+    while (next < count || !running.empty()) {
+        while (running.size() < jobs && next < count) {
+            RegChild ch;
+            ch.i = next++;
+            int p[2] = {-1, -1};
+            regtest_flush();
+            if (pipe(p) < 0 || (ch.pid = fork()) < 0) {
+                ch.out = std::string("cannot fork: ") + strerror(errno);
+                if (p[0] >= 0) {
+                    ::close(p[0]);
+                    ::close(p[1]);
+                }
+                failed += report(ch, 1 << 8);
+                continue;
+            }
+            if (ch.pid == 0) {
+                ::close(p[0]);
+                dup2(p[1], STDOUT_FILENO);
+                dup2(p[1], STDERR_FILENO);
+                ::close(p[1]);
+                setvbuf(stdout, nullptr, _IOLBF, 0);
+                regsink = nullptr;
+                child(ch.i);
+                _exit(0);
+            }
+            ::close(p[1]);
+            ch.fd = p[0];
+            running.push_back(std::move(ch));
+        }
+        fds.resize(running.size());
+        for (size_t i = 0; i < running.size(); i++) {
+            fds[i].fd = running[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0)
+            continue;
+        for (size_t i = fds.size(); i-- > 0;) {
+            if (!fds[i].revents)
+                continue;
+            char buf[4096];
+            ssize_t n = read(fds[i].fd, buf, sizeof buf);
+            if (n > 0) {
+                running[i].out.append(buf, n);
+            } else if (n == 0 || errno != EINTR) {
+                ::close(running[i].fd);
+                failed += report(running[i], wait_child(running[i].pid));
+                running.erase(running.begin() + i);
+            }
+        }
+    }
+    return failed;
+}
+
+static void print_output(const std::string &out) {
+    regtest_write(out.data(), out.size());
+    if (!out.empty() && out.back() != '\n')
+        regtest_write("\n", 1);
+}
+
+int regtest_run(unsigned jobs, unsigned timeout) {
+    std::vector<RegCase> &cases = regtest_cases();
+    int failed = fork_children(cases.size(), jobs,
+        [&](size_t i) {
+            alarm(timeout);
+            _exit(case_body(cases[i].fn));
+        },
+        [&](RegChild &ch, int status) {
+            bool f = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+            if (f)
+                fail_status(cases[ch.i].name, status, timeout);
+            else
+                regtest_print("PASS %s\n", cases[ch.i].name);
+            print_output(ch.out);
+            return f;
+        });
+    regtest_print("%d of %zu cases failed\n", failed, cases.size());
+    return failed;
+}
+
+thread_local RegFuzz *regfuzz = nullptr;
+
+/* Runs tried when minimizing the corruptions of a failing seed */
+enum { FUZZ_ATTEMPTS = 256 };
+
+/* Stateless mixing of the splitmix64 generator: the decisions of the fuzzer
+ * are hashes of the seed, the rule and the read number, rather than the
+ * output of a sequence, so that they do not depend on each other. */
+static inline uint64_t fuzz_mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/* Key of a rule: mixing the seed first keeps the rules of neighbouring seeds
+ * apart, where seed ^ rule would give rule 1 of seed 0 the key of rule 0 of
+ * seed 1. */
+static inline uint64_t fuzz_key(uint64_t seed, size_t rule) {
+    return fuzz_mix(fuzz_mix(seed) + rule);
+}
+
+void RegFuzz::fuzz(const volatile void *adr, uint64_t mask, double rate) {
+    Rule r;
+    r.adr = adr;
+    r.mask = mask;
+    r.threshold = rate >= 1 ? UINT64_MAX :
+                  rate <= 0 ? 0 : (uint64_t) (rate * 18446744073709551616.0);
+    r.key = fuzz_key(seed, rules.size());
+    r.reads = 0;
+    rules.push_back(r);
+}
+
+void RegFuzz::reset(uint64_t seed, const std::vector<uint32_t> *keep) {
+    this->seed = seed;
+    count = 0;
+    for (size_t i = 0; i < rules.size(); i++) {
+        rules[i].key = fuzz_key(seed, i);
+        rules[i].reads = 0;
+    }
+    keep_all = !keep;
+    this->keep.clear();
+    if (keep)
+        this->keep = *keep;
+    next_keep = 0;
+}
+
+uint64_t RegFuzz::apply(const volatile void *adr, uint64_t v) {
+    for (size_t i = 0; i < rules.size(); i++) {
+        Rule &r = rules[i];
+        if (r.adr != adr)
+            continue;
+        uint64_t h = fuzz_mix(r.key ^ r.reads++);
+        if (h >= r.threshold)
+            continue;
+        uint32_t n = count++;
+        if (shared)
+            *shared = count;
+        if (!keep_all) {
+            while (next_keep < keep.size() && keep[next_keep] < n)
+                next_keep++;
+            if (next_keep == keep.size() || keep[next_keep] != n)
+                continue;
+        }
+        v = (v & ~r.mask) | (fuzz_mix(h) & r.mask);
+    }
+    return v;
+}
+
+/* Run fn() under the current settings of fuzz in a grandchild, with its output
+ * discarded if quiet. Return whether it failed, its status and how many
+ * corruptions it drew. */
+static bool fuzz_attempt(RegFuzz &fuzz, void (*fn)(), unsigned timeout,
+                         bool quiet, int &status, uint32_t &count) {
+    volatile uint32_t *shared = fuzz.shared;
+    *shared = 0;
+    regtest_flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        status = 1 << 8;
+        count = 0;
+        regtest_print("cannot fork: %s\n", strerror(errno));
+        return true;
+    }
+    if (pid == 0) {
+        if (quiet) {
+            int fd = open("/dev/null", O_WRONLY);
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        alarm(timeout);
+        regfuzz = &fuzz;
+        _exit(case_body(fn));
+    }
+    status = wait_child(pid);
+    count = *shared;
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+static void print_keep(const std::vector<uint32_t> &keep) {
+    for (size_t i = 0; i < keep.size(); i++)
+        regtest_print("%s%u", i ? "," : "", keep[i]);
+}
+
+/* Child of one seed: if it fails, look for a small set of the corruptions that
+ * still fails by dropping ever smaller chunks of them (the simplified delta
+ * debugging of Zeller), then run the reduced set with its output shown. */
+static void fuzz_seed(RegFuzz &fuzz, void (*fn)(), uint64_t seed,
+                                                         unsigned timeout) {
+    void *map = mmap(nullptr, sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        regtest_print("Cannot map the counter of the fuzzer\n");
+        _exit(1);
+    }
+    fuzz.shared = (volatile uint32_t*) map;
+    int status;
+    uint32_t count;
+    fuzz.reset(seed);
+    if (!fuzz_attempt(fuzz, fn, timeout, true, status, count))
+        _exit(0);
+    std::vector<uint32_t> keep, cand;
+    for (uint32_t i = 0; i < count; i++)
+        keep.push_back(i);
+    unsigned attempts = 0;
+    for (size_t chunk = (keep.size() + 1) / 2; chunk && !keep.empty();
+                                                        chunk /= 2) {
+        for (size_t i = 0; i < keep.size() && attempts < FUZZ_ATTEMPTS;) {
+            cand.assign(keep.begin(), keep.begin() + i);
+            cand.insert(cand.end(),
+                        keep.begin() + std::min(i + chunk, keep.size()),
+                        keep.end());
+            fuzz.reset(seed, &cand);
+            int st;
+            uint32_t n;
+            attempts++;
+            if (fuzz_attempt(fuzz, fn, timeout, true, st, n))
+                keep.swap(cand);
+            else
+                i += chunk;
+        }
+        if (chunk == 1)
+            break;
+    }
+    char what[64];
+    snprintf(what, sizeof what, "seed %llu", (unsigned long long) seed);
+    fail_status(what, status, timeout);
+    regtest_print("%zu of %u corruptions kept, reproduce with REGTEST_FUZZ=%llu:",
+           keep.size(), count, (unsigned long long) seed);
+    print_keep(keep);
+    regtest_print("\n");
+    fuzz.reset(seed, &keep);
+    fuzz_attempt(fuzz, fn, timeout, false, status, count);
+    _exit(1);
+}
+
+/* Parse REGTEST_FUZZ, "seed" or "seed:ordinal,ordinal..." */
+static bool fuzz_parse(const char *s, uint64_t &seed,
+                       std::vector<uint32_t> &keep, bool &all) {
+    char *end;
+    seed = strtoull(s, &end, 0);
+    if (end == s)
+        return false;
+    all = *end != ':';
+    if (all)
+        return !*end;
+    for (s = end + 1; *s; s = *end ? end + 1 : end) {
+        keep.push_back(strtoul(s, &end, 0));
+        if (end == s || (*end && *end != ','))
+            return false;
+    }
+    std::sort(keep.begin(), keep.end());
+    return true;
+}
+
+int regtest_fuzz(RegFuzz &fuzz, void (*fn)(), uint64_t first, uint64_t count,
+                                              unsigned jobs, unsigned timeout) {
+    const char *env = getenv("REGTEST_FUZZ");
+    if (env) {
+        uint64_t seed;
+        std::vector<uint32_t> keep;
+        bool all;
+        if (!fuzz_parse(env, seed, keep, all)) {
+            regtest_print("\nInvalid REGTEST_FUZZ=%s\n", env);
+            return 1;
+        }
+        fuzz.reset(seed, all ? nullptr : &keep);
+        regfuzz = &fuzz;
+        fn();
+        int ret = expect_rest() != 0;
+        regfuzz = nullptr;
+        return ret;
+    }
+    int failed = fork_children(count, jobs,
+        [&](size_t i) {
+            fuzz_seed(fuzz, fn, first + i, timeout);
+        },
+        [&](RegChild &ch, int status) {
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+                return false;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 1) {
+                char what[64];
+                snprintf(what, sizeof what, "seed %llu",
+                         (unsigned long long) (first + ch.i));
+                fail_status(what, status, 0);
+            }
+            print_output(ch.out);
+            return true;
+        });
+    regtest_print("%d of %llu seeds failed\n", failed, (unsigned long long) count);
+    return failed;
+}
+
+void mem_store(const volatile void *adr, uint64_t v, uint8_t kind) {
+    volatile void *p = const_cast<volatile void*>(adr);
+    switch (kind & ~ROP_WRITE) {
+    case 1: *(volatile uint8_t*) p = v; break;
+    case 2: *(volatile uint16_t*) p = v; break;
+    case 4: *(volatile uint32_t*) p = v; break;
+    default: *(volatile uint64_t*) p = v; break;
+    }
+}
+
+uint64_t mem_load(const volatile void *adr, uint8_t kind) {
+    switch (kind & ~ROP_WRITE) {
+    case 1: return *(const volatile uint8_t*) adr;
+    case 2: return *(const volatile uint16_t*) adr;
+    case 4: return *(const volatile uint32_t*) adr;
+    default: return *(const volatile uint64_t*) adr;
+    }
+}
+
+int group_access(RegStream &s, const volatile void *adr, uint64_t v,
+                 uint8_t kind, uint64_t *val) {
+    ROp &op = s.front();
+    RegGroup &g = *(RegGroup*) op.ext;
+    int i = g.find(g.pending, g.left.data(), adr, v, kind);
+    if (i < 0)
+        return -1;
+    if (val)
+        *val = g.value(i, g.left.data());
+    if (--g.left[i] == 0)
+        g.pending &= ~(1ull << i);
+    if (--op.count == 0)
+        s.pop();
+    return i;
+}
+
+/* Check mode access to the block at the head of a queue, if it matches: the
+ * common case of a transfer through a FIFO register, which only advances the
+ * block. */
+static bool block_access(RegStream &s, const volatile void *adr, uint64_t &v,
+                                                                 uint8_t kind) {
+    ROp &op = s.front();
+    if (op.adr != adr || op.val != kind)
+        return false;
+    uint64_t e = block_op_access(op, 0).val;
+    if ((kind & ROP_WRITE) && e != v)
+        return false;
+    v = e;
+    op.ext = (const unsigned char*) op.ext + (kind & ~ROP_WRITE);
+    if (--op.count == 0)
+        s.pop();
+    return true;
+}
+
+REGTEST_NOINLINE
+void reg_write(RegStream &s, const volatile void *adr, uint64_t v,
+                                                         uint8_t kind) {
+    if (reghooks)
+        access_hooks(adr, v, kind);
+    if (reghooks & HOOK_LOG)
+        log_access(adr, v, kind);
+    if (s.model) {
+        s.model->on_write(adr, v);
+        if (regmode == REGTEST_RECORD)
+            trace_access(adr, v, kind);
+        return;
+    }
+    if (regmode == REGTEST_DEFERRED) {
+        s.log.push_back(Access{adr, v, kind});
+        return;
+    }
+    if (regmode == REGTEST_RECORD) {
+        mem_store(adr, v, kind);
+        trace_access(adr, v, kind);
+        return;
+    }
+    s.checked++;
+    if (!s.empty() && s.front().type == ROP_BLOCK &&
+                      !(reghooks & HOOK_IRQ) && block_access(s, adr, v, kind))
+        return;
+    int width = 2 * (kind & ~ROP_WRITE);
+    Access e;
+    if (reghooks & HOOK_IRQ)
+        front_irqs(s);
+    else
+        front_resolve(s);
+    front_log(s, adr, v, kind);
+    bool failed = true;
+    if (!s.empty() && s.front().type == ROP_GROUP) {
+        if (group_access(s, adr, v, kind) >= 0)
+            failed = false;
+        else
+            regtest_fail("Unexpected write of 0x%0*llx to address %p",
+                         width, (unsigned long long) v, adr);
+    } else if (s.empty() || (e = front_access(s)).kind != kind || e.adr != adr)
+        regtest_fail("Unexpected write of 0x%0*llx to address %p",
+                     width, (unsigned long long) v, adr);
+    else if (e.val != v)
+        regtest_fail("Unexpected value 0x%0*llx of write to address %p",
+                     width, (unsigned long long) v, adr);
+    else {
+        front_consume(s);
+        failed = false;
+    }
+    if (failed && fail_deferred(s))
+        s.log.push_back(Access{adr, v, kind});
+    if (reghooks & HOOK_IRQ)
+        front_irqs(s);
+}
+
+static uint64_t read_access(RegStream &s, const volatile void *adr,
+                                                        uint8_t kind) {
+    if (reghooks)
+        access_hooks(adr, 0, kind);
+    if (s.model) {
+        uint64_t v = s.model->on_read(adr);
+        if (regfuzz)
+            v = regfuzz->apply(adr, v);
+        if (regmode == REGTEST_RECORD)
+            trace_access(adr, v, kind);
+        return v;
+    }
+    if (regmode == REGTEST_DEFERRED)
+        return deferred_read(s, adr, kind);
+    if (regmode == REGTEST_RECORD) {
+        uint64_t v = mem_load(adr, kind);
+        trace_access(adr, v, kind);
+        return v;
+    }
+    s.checked++;
+    uint64_t v;
+    if (!s.empty() && s.front().type == ROP_BLOCK &&
+                      !(reghooks & HOOK_IRQ) && block_access(s, adr, v, kind))
+        return v;
+    Access e;
+    if (reghooks & HOOK_IRQ)
+        front_irqs(s);
+    else
+        front_resolve(s);
+    if (!s.empty() && s.front().type == ROP_GROUP) {
+        int i = group_access(s, adr, 0, kind, &v);
+        if (i < 0) {
+            regtest_fail("Unexpected read at address %p", adr);
+            return fail_deferred(s) ? deferred_read(s, adr, kind) :
+                                     (uint64_t) -1;
+        }
+        if (reghooks & HOOK_IRQ)
+            front_irqs(s);
+        return v;
+    }
+    if (s.empty() || (e = front_access(s)).kind != kind || e.adr != adr) {
+        front_log(s, adr, (uint64_t) -1, kind);
+        regtest_fail("Unexpected read at address %p", adr);
+        return fail_deferred(s) ? deferred_read(s, adr, kind) : (uint64_t) -1;
+    }
+    if (s.front().type == ROP_GEN) {
+        e.val = gen_next(s.front());
+        if (regfuzz)
+            e.val = regfuzz->apply(adr, e.val);
+    }
+    front_log(s, adr, e.val, kind);
+    front_consume(s);
+    if (reghooks & HOOK_IRQ)
+        front_irqs(s);
+    return e.val;
+}
+
+/* Reads are logged once their value is known */
+REGTEST_NOINLINE
+uint64_t reg_read(RegStream &s, const volatile void *adr, uint8_t kind) {
+    uint64_t v = read_access(s, adr, kind);
+    if (reghooks & HOOK_LOG)
+        log_access(adr, v, kind);
+    return v;
+}
+
+} /* namespace regtest */
@@ -69,15 +69,577 @@ void test_periph_start() {
 The "expect_*" Procedures
 -------------------------
 
-    void expect_read(const volatile uint32_t*, uint32_t);
-    void expect_write(const volatile uint32_t*, uint32_t);
+    void expect_read(const volatile T*, T);
+    void expect_write(const volatile T*, T);
+    void expect_read_n(const volatile T*, T val, uint32_t count);
+    void expect_poll_until(const volatile T*, T idle_val, T done_val,
+                           uint32_t reads);
     int expect_rest();
 
+    These functions are templates over the register type T, which is one of
+uint8_t, uint16_t, uint32_t or uint64_t according to the mock register (see
+below).
+
     Both expect_read and expect_write add one expected memory operation to the
 queue "ropq". The "expect_rest()" function fails by raising a signal if there
 remains an expected operation in the queue; it's return code is 0 if and only
 is succeeds.
 
+    Polling loops are described with a single queue entry whatever the number
+of reads: expect_read_n expects "count" reads all yielding "val", and
+expect_poll_until expects "reads" reads, the last of which yields "done_val"
+while the previous ones yield "idle_val". The status register polling of the
+example above may thus be written:
+
+    expect_poll_until(&periph->isr, 0x00, 0x01, 4);
+
+    void expect_reserve(size_t n);
+
+    The queue is a ring buffer in a single array which grows as needed. Long
+scripts may call expect_reserve beforehand to make room for "n" queued
+operations at once, so that building and running the script never allocates.
+
+
+Static Scripts
+--------------
+
+    SOp SCRIPT_READ(type, reg, val);
+    SOp SCRIPT_WRITE(type, reg, val);
+    SOp SCRIPT_READ_N(type, reg, val, count);
+    SOp SCRIPT_POLL_UNTIL(type, reg, idle_val, done_val, reads);
+    void expect_script(const volatile void *base, const SOp (&script)[N]);
+    void expect_script(const volatile void *base, const SOp *script, size_t n);
+
+    Scripts which are known at compile time may be declared as constexpr arrays
+of SOp entries, which name registers by their offset in the peripheral
+structure, so that the whole table lives in read-only memory:
+
+    static constexpr SOp dev_init[] = {
+        SCRIPT_WRITE(Device, cr, 0x01),
+        SCRIPT_POLL_UNTIL(Device, isr, 0x00, 0x01, 3),
+        SCRIPT_READ(Device, dr, 0x42),
+    };
+
+    expect_script(dev, dev_init);
+
+    expect_script() queues the whole table as a single operation, relative to
+the peripheral at base, which is consumed in place: no entry is copied, and
+nothing is allocated once the queue has room. The same table may thus serve
+every test, and every instance of a peripheral. Scripts are checked in every
+mode, but cannot be part of an unordered group or be sent to another process.
+
+
+Peripheral Ids
+--------------
+
+    void regtest_bind(uint8_t periph, const volatile void *base);
+    POp PERIPH_READ(periph, type, reg, val);
+    POp PERIPH_WRITE(periph, type, reg, val);
+    void expect_script(const POp (&script)[N]);
+    void expect_script(const POp *script, size_t n);
+
+    A static script may also involve several peripherals, such as a UART and
+the DMA channel which feeds it, by naming each register with a peripheral id
+and its offset in the peripheral structure. regtest_bind() binds an id to the
+base address of a peripheral instance, and the same compiled script then drives
+any instance, for example UART0 to UART7 in turn:
+
+    enum { UART, DMA };
+    static constexpr POp xfer[] = {
+        PERIPH_WRITE(DMA, Dma, cnt, 16),
+        PERIPH_WRITE(UART, Uart, cr, 0x01),
+        PERIPH_READ(UART, Uart, sr, 0x80),
+    };
+
+    regtest_bind(DMA, dma);
+    for (int i = 0; i < 8; i++) {
+        regtest_bind(UART, uart[i]);
+        expect_script(xfer);
+        uart_send(uart[i]);
+        expect_rest();
+    }
+
+    Each POp entry is one access of at most 32 bits, packed in 8 bytes, so that
+long scripts stay small in the cache. The ids are resolved as the accesses
+occur, and must be bound when the script is queued. When the peripherals belong
+to different streams, each run of entries of the same stream is queued to that
+stream, and the script is then only ordered within each stream. The offsets
+must fit on 16 bits and the registers on 32 bits, which the macros check at
+compile time.
+
+
+Block Transfers
+---------------
+
+    void expect_write_block(const volatile T* adr, const T *buf, uint32_t count);
+    void expect_read_block(const volatile T* adr, const T *buf, uint32_t count);
+
+    A transfer through a FIFO data register is expected with a single call:
+expect_write_block() expects count writes at adr of the successive values of
+buf, and expect_read_block() expects count reads at adr, which yield these
+values. The buffer is not copied, and must be kept until the accesses occur;
+each access only advances the block to the next element, so that megabytes may
+go through a register without queuing an operation per access. Blocks are
+checked in every mode, but like traces they cannot be part of an unordered
+group or be sent to another process.
+
+
+Generated Read Values
+---------------------
+
+    void expect_read_gen(const volatile T*, uint32_t count, F fn);
+
+    Free-running counters, timers or random number registers are expected with
+expect_read_gen, which takes one place in the queue for count reads whatever
+their number. Each of these reads yields the value returned by fn(), called
+when the read occurs. fn may be any callable, and it may keep a state, for
+instance a counter that increments by 3 on every read:
+
+    uint32_t ticks = 0;
+    expect_read_gen(&periph->cnt, 1000, [&ticks]() { return ticks += 3; });
+
+    The callable is copied, and inlined in a function that the mock register
+calls indirectly. Generated reads may not be part of unordered groups.
+
+
+Interrupts
+----------
+
+    void expect_interrupt(void (*handler)(), const volatile void *adr = nullptr);
+
+    To test an interrupt service routine, and the race windows between it and
+the rest of the driver, expect_interrupt() queues a call to handler in the
+stream of adr. The handler runs synchronously, as soon as the operations
+expected before it have occurred: right after the access that consumes the last
+of them, or before the first access if it is at the head of the queue. Its own
+accesses are checked against the operations expected after it. For instance,
+the handler runs right after the third read of isr here:
+
+    expect_poll_until(&dev->isr, 0, 0, 3);
+    expect_interrupt(dev_isr);
+    expect_read(&dev->dr, 0x42);     // read by dev_isr()
+
+    While interrupts are queued, every access takes the slow path of the mock
+registers, so that scripts without interrupts pay nothing for them. Interrupts
+are only run in REGTEST_CHECK mode, and cannot be part of an unordered group or
+be sent to another process.
+
+
+Unordered Groups
+----------------
+
+    void expect_group_begin();
+    void expect_group_end();
+    expect_any_order { ... }
+
+    The operations expected between expect_group_begin() and
+expect_group_end(), or within an expect_any_order block, form a group of up to
+64 operations that may occur in any order, for instance configuration writes:
+
+    expect_write(&periph->cr, 0x00);
+    expect_any_order {
+        expect_write(&periph->baud, 115200);
+        expect_write(&periph->fmt, 0x03);
+    }
+    expect_write(&periph->cr, 0x01);
+
+    The group takes one place in the queue of its first operation, and all of
+its operations must be with it in that stream. Each access is matched only
+against the pending operations of the group at its address, so it remains as
+fast whatever the size of the group. Groups may be nested, for instance when a
+helper which expects an expect_any_order block is called within another one:
+the operations of the inner group are then part of the outer one, which ends
+with the outermost expect_group_end().
+
+
+Expectation Streams
+-------------------
+
+    RegStream::RegStream(const volatile void *base, size_t size);
+
+    The queue "ropq" imposes a total order on all the accesses. When a driver
+uses several peripherals alternately, a RegStream object may be bound to the
+address range of each peripheral, for instance RegStream uart(uart_regs, sizeof
+*uart_regs). The expected operations on the registers of that range, and the
+accesses to them, then go to the stream instead of "ropq", and each stream
+keeps its own order; the test no longer needs to spell out the exact
+interleaving of the accesses to different peripherals. expect_rest() checks all
+the streams, and a stream stops receiving operations when it is destroyed.
+Streams and models may also be global objects, destroyed after the end of the
+thread which created them.
+Traces are queued in the stream of their base address. A stream whose range
+overlaps the range of another stream fails.
+
+
+Peripheral Models
+-----------------
+
+    class RegModel : public RegStream {
+      public:
+        RegModel(const volatile void *base, size_t size);
+        virtual uint64_t on_read(const volatile void *adr) = 0;
+        virtual void on_write(const volatile void *adr, uint64_t val) = 0;
+    };
+
+    Long running tests may replace the script of a peripheral with a behavioral
+model. A model is a stream whose accesses are handed to its on_read and
+on_write hooks, through a single virtual call, instead of being checked against
+a queue. For instance, a device that becomes ready three reads after being
+started:
+
+    struct DeviceModel : RegModel {
+        DeviceModel(volatile Peripheral *p) : RegModel(p, sizeof *p), p(p) {}
+        uint64_t on_read(const volatile void *adr) {
+            return adr == &p->isr && wait && !--wait;
+        }
+        void on_write(const volatile void *adr, uint64_t val) {
+            if (adr == &p->cr && (val & CR_START))
+                wait = 3;
+        }
+        volatile Peripheral *p;
+        unsigned wait = 0;
+    };
+
+    Models ignore the access mode, but their accesses are recorded in
+REGTEST_RECORD mode, so that a model may produce a golden trace.
+
+
+Checkpoints
+-----------
+
+    RegCheckpoint::RegCheckpoint();
+    void RegCheckpoint::restore();
+
+    Tests which share a long common prefix, such as the initialization sequence
+of a device, may build it once: a RegCheckpoint takes a snapshot of the
+expectations of every stream (the queue, the access log of deferred mode and
+the state of the unordered groups), and restore() puts them back as they were,
+with one bulk copy per stream which only allocates the first time. Each variant
+then restores the checkpoint, queues its own tail, runs, and calls
+expect_rest():
+
+    init_script();
+    RegCheckpoint init;
+    for (uint32_t v = 0; v < 256; v++) {
+        init.restore();
+        expect_write(&dev->dr, v);
+        run_variant(v);
+        expect_rest();
+    }
+
+    While checkpoints exist, the groups, generators and traces of the script
+are kept until one expect_rest() after the last is destroyed. The streams must
+outlive the checkpoint. Channels and the functions of generators cannot be
+rewound by a checkpoint, so that they are better left out of a shared prefix.
+
+
+Deferred Verification
+---------------------
+
+    void regtest_set_mode(RegMode);
+
+    By default (REGTEST_CHECK mode) every access is checked against the head
+of the queue when it happens. In REGTEST_DEFERRED mode, the mock registers
+only append each access to a flat access log, reads being served in order from
+the read operations of the queue. The next call to expect_rest() then checks
+the whole log against the queue in one pass, reports the first difference, and
+empties both. Calling expect_reserve() after selecting this mode also reserves
+room in the log.
+
+
+Differences on Failure
+----------------------
+
+    When the failures are let through (REGTEST_FAIL_CONTINUE), the first
+failure in REGTEST_CHECK mode switches to REGTEST_DEFERRED mode until the next
+expect_rest(), so that the rest of the test is logged. expect_rest(), which
+then finds a difference between the log and the queue, also prints a minimal
+edit script between them: the expected operations which did not occur (-) and
+the unexpected accesses (+), with the position of each in the log. An extra
+read 50000 accesses into the test thus shows up as a single line, instead of as
+a failure of every access that follows: the values served to the reads of the
+log come from the queue instead of being observed, so that reads match on their
+address and width alone, and writes on their value too. The edit script is computed with the
+linear space variant of the Myers diff algorithm, whose memory use is
+proportional to the length of the log; the work is also bounded, and when the
+log differs too much from the queue the edit script is abandoned, leaving only
+the first difference.
+
+
+Live Channels
+-------------
+
+    RegChannel::RegChannel(size_t capacity = 4096);
+    void RegChannel::push(const ROp&);
+    void RegChannel::expect_read(const volatile T*, T);
+    void RegChannel::expect_write(const volatile T*, T);
+    void RegChannel::expect_poll_until(const volatile T*, T idle, T done,
+                                       uint32_t reads);
+    void RegChannel::close();
+    void expect_from_channel(RegChannel&, const volatile void *adr = nullptr);
+
+    A simulator running in another thread may produce the expected operations
+while the tested code runs. expect_from_channel() queues a channel, in the
+stream of adr, and when the tested code reaches it, its accesses are checked
+against the operations pushed to the channel by the simulator, until the
+simulator closes it. The channel is a bounded single producer, single consumer
+ring, which takes no lock as long as it is neither full nor empty; the waiting
+side spins briefly, then sleeps. Channels are consumed in REGTEST_CHECK mode,
+and carry single operations only.
+
+
+Shared Memory Transport
+-----------------------
+
+    int RegShm::create(const char *name, const volatile void *base = nullptr,
+                       size_t capacity = 65536);
+    int RegShm::open(const char *name, const volatile void *base = nullptr);
+    void RegShm::close(int status = 0);
+    bool RegShm::next_access(Access&);
+    void expect_to_shm(RegShm&);
+    void expect_from_shm(RegShm&, const volatile void *adr = nullptr);
+
+    The test script and the tested code may also run in different processes,
+for example when the tested code is a separate executable or crashes on
+purpose. The script creates a named shared memory region with create(), calls
+expect_to_shm(), and then its expect_* calls send the expected operations to
+the tested process instead of queuing them. The tested process opens the same
+region with open(), and calls expect_from_shm() to check its accesses against
+these operations; it ends with close(expect_rest()) to report its result.
+
+    The region holds two single producer, single consumer rings, the expected
+operations and the access log, so that no system call is made as long as both
+sides keep up. Addresses are relative to the base given by each side, since the
+registers need not be mapped at the same address in both processes. On the
+script side, expect_rest() waits for the tested process to close the region,
+and fails if the test failed in the tested process or if that process exited
+without closing the region. next_access() returns the accesses of the tested
+process one at a time, while the test runs or after expect_rest(), until the
+next expect_to_shm(). Only single and run-length operations can be sent to
+another process: unordered groups, blocks and scripts fail when they are.
+
+
+Trace Recording
+---------------
+
+    int trace_record(const char *path, const volatile void *base = nullptr);
+    int trace_stop();
+
+    trace_record() switches to REGTEST_RECORD mode, where the mock registers
+check nothing: they behave as plain memory (which must then exist), and every
+access is appended to the binary trace file "path". Each record holds the
+address relative to "base", the value, the kind of access and its sequence
+number. Records are written to the file in large blocks, and trace_stop()
+writes the last one, closes the file and goes back to REGTEST_CHECK mode. Both
+return 0 if and only if they succeed.
+
+    int expect_from_trace(const char *path, const volatile void *base = nullptr);
+
+    expect_from_trace() queues all the accesses of a recorded trace as expected
+operations, with addresses relative to "base". The trace file is mapped in
+memory and its records are used in place, without being copied into the queue;
+it is unmapped when the queue is emptied by expect_rest().
+
+
+Access Statistics
+-----------------
+
+    void regstats_enable(bool on);
+    void regstats_report(FILE *out = stdout);
+    void regstats_clear();
+
+    While enabled, the mock registers count the reads and writes made to each
+address. regstats_report() prints the counters, most accessed registers first,
+and expect_rest() prints and clears them. This shows which polling loops and
+redundant writes would cost the most bus cycles on the real hardware.
+
+
+Access Pattern Analysis
+-----------------------
+
+    void regtest_analyze_enable(bool on);
+    void analysis_report(FILE *out = stdout);
+    void analysis_clear();
+    void analyze_log(const std::vector<Access> &log, FILE *out = stdout);
+
+    To find bus traffic that the tested code could save,
+regtest_analyze_enable(true) compares each access with the previous one, and
+reports at every expect_rest() (or when calling analysis_report()) the wasteful
+patterns it found: a read of a register right after a write to it, a write of
+the value a register was just written, a run of at least 16 back to back reads
+of one register (polling without backoff), and writes to adjacent registers
+which could be merged into one aligned access of twice the width. Findings are
+aggregated per pattern and address, with their count, the number of accesses
+involved, and the position of the first one in the test. The analysis works in
+every mode, and analyze_log() applies it to an access log, such as the log of a
+stream in deferred mode or the accesses of another process, and reports on it
+alone: the findings of the test carry on afterwards.
+
+
+Access Budgets
+--------------
+
+    void expect_access_budget(uint64_t accesses);
+    void expect_access_budget(const volatile void *adr, size_t size,
+                              uint64_t accesses);
+    void access_history_report(FILE *out = stdout);
+
+    A driver bug may leave a polling loop spinning forever, for instance on a
+generated read value, or in a model that never completes.
+expect_access_budget() limits the number of register accesses of each test, in
+total or to the address range [adr, adr + size), and the counters restart with
+every expect_rest(). A test which exceeds a budget fails on the spot and prints
+its last 16 accesses, to show where it was stuck; since the loop would
+otherwise go on spinning, it is aborted even with REGTEST_FAIL_CONTINUE.
+access_history_report() prints these accesses at any time while budgets are
+set. Like the other instrumentation, budgets only cost a flag test when none is
+set. A budget range which overlaps another budget range fails.
+
+
+Bus Time
+--------
+
+    void bus_cost(const volatile void *adr, size_t size, uint32_t read_cycles,
+                                                         uint32_t write_cycles);
+    void bus_cost_default(uint32_t read_cycles, uint32_t write_cycles);
+    void expect_bus_budget(uint64_t cycles);
+    uint64_t bus_time();
+
+    Each access of the real hardware costs bus cycles. bus_cost() sets the cost
+of the reads and writes to the registers in [adr, adr + size), and
+bus_cost_default() the cost of the accesses to any other register. Once a cost
+is set, every access advances a virtual clock by its cost, which bus_time()
+returns. expect_rest() prints the bus time of the test and restarts the clock;
+it fails if that time exceeds the budget set by expect_bus_budget() for the
+test. This flags latency regressions, like a driver that picks up three extra
+status reads on its hot path, without hardware in the loop. A cost range which
+overlaps another cost range fails.
+
+
+Passthrough Registers
+---------------------
+
+    When REGTEST_PASSTHROUGH is defined before including regtest.h, the mock
+registers compile down to plain volatile loads and stores of their underlying
+memory, and the expect_* procedures do nothing (expect_rest() always succeeds).
+The same code may thus be built checked to test its accesses, or unchecked to
+time it on the host with the registers backed by real memory, without the
+#define Reg32 uint32_t trick.
+
+
+Compiled Runtime
+----------------
+
+    By default regtest.h is header-only: it includes regtest.cc at its end, so
+a test is a single translation unit and gets the fastest checks. Larger tests
+made of several translation units may instead link the runtime once:
+
+    make lib
+    g++ -DTEST -DREGTEST_LIB -I. -c test_uart.cc test_spi.cc
+    g++ -o tests test_uart.o test_spi.o libregtest.a
+
+  - REGTEST_LIB must be defined in every translation unit that includes
+    regtest.h, and in none of them is using namespace std implied.
+  - The library must be built with the same REGTEST_FAIL and
+    REGTEST_PASSTHROUGH settings as the tests, since
+    regtest.o is compiled with them.
+  - The checks of the inline fast path stay in the header, but the state they
+    read is then reached through thread_local wrappers, which costs about a
+    nanosecond per access.
+  - Only the interface documented here is brought into the global namespace:
+    the internals of the runtime stay in namespace regtest, so that they
+    cannot clash with the names of the tests.
+  - The declarations only include a few light standard headers, since the
+    threads, processes and files of the runtime are kept in regtest.o: a
+    test that uses std::thread or std::string includes their headers itself.
+
+
+Test Runner
+-----------
+
+    A failure stops the test program by default, so that a debugger may catch
+it. Tests made of many cases may instead have each of them run by a child
+process forked from a warmed-up parent: a failing case then only takes its own
+child down, and the fixtures are built once.
+
+    REGTEST_CASE(uart_init) {
+        expect_write(&uart->cr, UART_EN);
+        uart_init();
+    }
+
+    int main() {
+        build_shared_scripts();           // inherited by every case
+        return regtest_run() != 0;
+    }
+
+    regtest_run(jobs, timeout) runs up to jobs children in parallel, one per
+online CPU by default, and kills those still running after timeout seconds when
+it is not 0. Each child runs its case followed by expect_rest(), and sends its
+output back over a pipe. The parent prints it after the verdict of the case, so
+that the output of parallel cases does not interleave, and returns the number
+of failed cases. Cases may also be added at run time with
+regtest_add_case(name, fn).
+
+    Every child starts from a copy of the state of the calling thread: whatever
+it expects, models or checkpoints is shared by all the cases without being
+rebuilt, and nothing a case does reaches the parent or the other cases. Other
+threads, such as the simulators feeding live channels, are not copied into the
+children.
+
+    The cases of examples/cases.cc, which make test runs, each exercise one
+feature of the library on small UART, timer, sensor and DMA drivers.
+
+
+Fuzzing
+-------
+
+    class RegFuzz {
+      public:
+        void fuzz(const volatile void *adr, uint64_t mask, double rate);
+    };
+    int regtest_fuzz(RegFuzz &fuzz, void (*fn)(), uint64_t first,
+                     uint64_t count, unsigned jobs = 0, unsigned timeout = 0);
+
+    The robustness of a driver is tested by corrupting, under a seed, the
+values that models and generators provide for some registers. Each rule of a
+RegFuzz replaces the bits of mask by random ones in a fraction rate of the
+reads at adr, for instance to raise error bits and spurious ready flags once
+every thousand reads:
+
+    RegFuzz fuzz;
+    fuzz.fuzz(&uart->isr, ISR_ERR | ISR_OVR | ISR_RXNE, 0.001);
+    return regtest_fuzz(fuzz, rx_loop, 1, 10000) != 0;
+
+    regtest_fuzz runs fn() followed by expect_rest() under each seed from first
+to first + count - 1, in children forked as by regtest_run, thus sharing its
+fixtures, parallelism and timeout. Scripted reads are never corrupted, since
+they are exact expectations.
+
+    Whether the n-th read of a rule is corrupted, and how, is a hash of the
+seed, the rule and n, so that a run is reproduced from its seed alone. A
+failing seed is then minimized: its corruptions are numbered in the order they
+were drawn, and chunks of them are dropped as long as the run still fails. The
+verdict gives the reduced set, which is run once more with its output shown:
+
+    FAIL seed 64 (Interrupt)
+    3 of 6 corruptions kept, reproduce with REGTEST_FUZZ=64:2,3,5
+
+    When REGTEST_FUZZ is set to a seed, optionally followed by the kept
+corruptions, regtest_fuzz makes only that run, in the calling process, where a
+debugger catches its failure. The corruption of a read costs a couple of
+hashes, and a seed two forks, so that a small driver loop runs for hundreds of
+millions of iterations per minute and per core.
+
+
+Threads
+-------
+
+    All the state of the library (queues, streams, modes and instrumentation)
+is thread local. Independent tests may thus run in parallel on several threads
+of one process, each thread getting its own queue "ropq" and its own streams,
+without any locking on the accesses of the mock registers. The accesses of a
+thread are checked against the expected operations of that thread only.
+
 
 The "Reg32" Type
 ----------------
@@ -89,6 +651,11 @@ Converting this value to uint32_t is overloaded to look in the queue instead
 of the underlying register. Finally, getting the address of this value returns
 the address of the underlying register.
 
+    Reg32 is the 32 bits instance of the RegN<T> template. Reg8, Reg16 and
+Reg64 are provided likewise for uint8_t, uint16_t and uint64_t registers. All
+widths share the same queue, and an access only matches an expected operation
+of the same width.
+
 
 Output
 ------
@@ -99,6 +666,64 @@ a debugger:
 
     raise(SIGINT)
 
+    Another failure policy may be selected at compile time by defining
+REGTEST_FAIL before including this file:
+
+    #define REGTEST_FAIL REGTEST_FAIL_TRAP      // raise(SIGINT), the default
+    #define REGTEST_FAIL REGTEST_FAIL_ABORT     // abort()
+    #define REGTEST_FAIL REGTEST_FAIL_THROW     // throw RegFailure
+    #define REGTEST_FAIL REGTEST_FAIL_CONTINUE  // carry on, expect_rest() fails
+
+    Failures are handled out of line, so that the matching of an access that
+goes as expected remains small enough to be inlined in the tested code.
+
+
+Output Sinks
+------------
+
+    class RegSink {
+      public:
+        virtual void text(const char *s, size_t len) = 0;
+        virtual void access(uint64_t seq, const Access &a) = 0;
+        virtual void flush() {}
+    };
+    void regtest_set_sink(RegSink *sink);
+    void regtest_log_accesses(bool on);
+
+    The failure messages and reports of the library may be sent to a sink
+instead of being written to stdout as they are produced. RegFileSink writes
+plain text to a stream or to a file, and RegJsonSink writes JSON lines, one
+object per line of text or per access. When enabled by regtest_log_accesses,
+every access is sent to the sink, with its value, as a {"seq", "op", "size",
+"adr", "val"} record.
+
+    Timing-sensitive tests wrap a sink in a RegAsyncSink, which forwards to it
+from a background thread:
+
+    RegJsonSink json("regtest.jsonl");
+    RegAsyncSink async(json);
+    regtest_set_sink(&async);
+    regtest_log_accesses(true);
+
+    Each thread that produces output gets its own lock-free ring (1 MiB by
+default), so that logging an access costs a copy of its record into the ring,
+and the formatting is left to the background thread. A full ring makes the
+producer wait for the drain. The output is flushed before a failure stops the
+test or the runner forks. Forked children have no background thread, so they
+forward their output synchronously, and the runner sends the output of its
+cases to its own sink. The sink is set per thread, and must outlive its use.
+
+
+Benchmarks
+----------
+
+    make bench
+
+    The micro-benchmarks in bench/bench.cc time the queuing of expected
+operations, the matched accesses of the mock registers, and the bulk check of
+expect_rest() in deferred mode, over scripts of 10 to 10^7 operations. They print the time and the number of heap
+allocations per operation, to check changes of the library for regressions.
+
 
 Security Considerations
 -----------------------
@@ -110,99 +735,1383 @@ security. It is trivial to work around it:
 
 */
 
+#ifndef REGTEST_H
+#define REGTEST_H
+
 #ifndef __cplusplus
 #warning Use a C++ compiler
 #endif
 
+#ifndef REGTEST_LIB
 using namespace std;
+#endif
 
+/* The threads, processes and files of the runtime need more headers, which
+ * regtest.cc includes, so that the tested code does not compile them */
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
-#include <queue>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__GNUC__)
+#define REGTEST_COLD __attribute__((cold, noinline))
+#define REGTEST_NOINLINE __attribute__((noinline))
+#define REGTEST_LIKELY(x) __builtin_expect(!!(x), 1)
+#else
+#define REGTEST_COLD
+#define REGTEST_NOINLINE
+#define REGTEST_LIKELY(x) (x)
+#endif
 
-#include <sys/signal.h>
+
+/* Failure policies, selected at compile time by defining REGTEST_FAIL before
+ * including this file:
+ *   REGTEST_FAIL_TRAP      raise(SIGINT) to grab the attention of a debugger
+ *   REGTEST_FAIL_ABORT     abort() the test program
+ *   REGTEST_FAIL_THROW     throw a RegFailure exception
+ *   REGTEST_FAIL_CONTINUE  count the failure and carry on, expect_rest() then
+ *                          fails */
+#define REGTEST_FAIL_TRAP     0
+#define REGTEST_FAIL_ABORT    1
+#define REGTEST_FAIL_THROW    2
+#define REGTEST_FAIL_CONTINUE 3
+
+#ifndef REGTEST_FAIL
+#define REGTEST_FAIL REGTEST_FAIL_TRAP
+#endif
+
+#if REGTEST_FAIL == REGTEST_FAIL_THROW
+#include <stdexcept>
+#endif
+
+/* Everything but the macros lives in namespace regtest, so that the internals
+ * of the library do not clash with the names of the tests and drivers which
+ * include it. The interface is brought into the global namespace at the end
+ * of this file. */
+namespace regtest {
+
+#if REGTEST_FAIL == REGTEST_FAIL_THROW
+struct RegFailure : std::runtime_error {
+    explicit RegFailure(const std::string &what) : std::runtime_error(what) {}
+};
+#endif
+
+/* Number of failures let through since the last expect_rest() */
+extern thread_local unsigned regfailures;
+
+/* Report a failure, and handle it according to the policy. This is kept out
+ * of line so that the matching paths stay small. */
+REGTEST_COLD __attribute__((format(printf, 1, 2)))
+void regtest_fail(const char *fmt, ...);
 
 
 /* This structure stores one expected register operation: either one write of
  * a given value to a given address, or a read at a given address that is
- * should yield a certain value in the context of the test script. */
+ * should yield a certain value in the context of the test script. One ROp may
+ * stand for a run of "count" identical accesses, in which case the last access
+ * of the run uses "last" instead of "val" (this models polling loops).
+ * Registers of every width share the same queue: values are stored on 64 bits
+ * and "kind" holds the access width in bytes, or'ed with ROP_WRITE for writes,
+ * so that a single comparison checks both the direction and the width.
+ *     Other types of ROp stand for a whole sequence of operations stored
+ * elsewhere, pointed to by "ext". Their kind is 0, so that they never match an
+ * access directly and take the slow path instead. A ROP_TRACE operation replays
+ * "count" records of a mapped trace, "adr" being the base address they are
+ * relative to. A ROP_GROUP operation stands for the "count" accesses of a
+ * RegGroup, which may occur in any order. A ROP_GEN operation stands for
+ * "count" reads at "adr", whose values are produced by a RegGen. A
+ * ROP_SOURCE operation stands for all the operations provided by a RegSource,
+ * such as a RegChannel, until it is closed. A ROP_IRQ operation stands for no
+ * access at all: the interrupt handler "irq" is run when the queue reaches it.
+ * A ROP_BLOCK operation stands for "count" accesses at "adr", of kind "val",
+ * whose values are the successive elements of the caller's buffer "ext". A
+ * ROP_SCRIPT operation stands for the "count" accesses of a static SOp table,
+ * relative to the peripheral base "adr": "ext" points to the current entry,
+ * and "val" counts the accesses of this entry that already occurred. A
+ * ROP_PSCRIPT operation stands for "count" accesses of a table of POp, "ext"
+ * pointing to the next one. */
+enum { ROP_WRITE = 0x80 };
+enum { ROP_SINGLE, ROP_TRACE, ROP_GROUP, ROP_GEN, ROP_SOURCE, ROP_IRQ,
+       ROP_BLOCK, ROP_SCRIPT, ROP_PSCRIPT };
+
 struct ROp {
-    ROp(const volatile uint32_t *adr, uint32_t val, bool write) : adr(adr),
-                                                     val(val), write(write) {}
-    const volatile uint32_t *adr;
+    ROp() {}
+    ROp(const volatile void *adr, uint64_t val, uint64_t last, uint32_t count,
+        uint8_t kind) : adr(adr), val(val), last(last), count(count),
+                                                  kind(kind), type(ROP_SINGLE) {}
+    ROp(uint8_t type, const volatile void *adr, const void *ext, uint32_t count)
+        : adr(adr), val(0), ext(ext), count(count), kind(0), type(type) {}
+    const volatile void *adr;
+    uint64_t val;
+    union {
+        uint64_t    last;
+        const void *ext;
+        void      (*irq)();
+    };
+    uint32_t count;
+    uint8_t  kind;
+    uint8_t  type;
+};
+
+/* Entry of a static script: "count" accesses of kind "kind" to the register
+ * at offset "off" of a peripheral, the last one using "last" instead of "val"
+ * (as in ROp). Being a literal type, whole scripts may be constexpr arrays,
+ * built with the SCRIPT_* macros from the peripheral structure, that live in
+ * read-only memory and are consumed in place. */
+struct SOp {
+    constexpr SOp(uint32_t off, uint8_t kind, uint64_t val, uint64_t last,
+                  uint32_t count) : val(val), last(last), off(off),
+                                    count(count), kind(kind) {}
+    uint64_t val;
+    uint64_t last;
+    uint32_t off;
+    uint32_t count;
+    uint8_t  kind;
+};
+
+#define SCRIPT_KIND_(type, reg) ((uint8_t) sizeof(((type*) 0)->reg))
+#define SCRIPT_READ(type, reg, val) \
+    regtest::SOp(offsetof(type, reg), SCRIPT_KIND_(type, reg), val, val, 1)
+#define SCRIPT_WRITE(type, reg, val) \
+    regtest::SOp(offsetof(type, reg),                                       \
+                 SCRIPT_KIND_(type, reg) | regtest::ROP_WRITE, val, val, 1)
+#define SCRIPT_READ_N(type, reg, val, count) \
+    regtest::SOp(offsetof(type, reg), SCRIPT_KIND_(type, reg), val, val, count)
+#define SCRIPT_POLL_UNTIL(type, reg, idle_val, done_val, reads) \
+    regtest::SOp(offsetof(type, reg), SCRIPT_KIND_(type, reg), idle_val,    \
+                 done_val, reads)
+
+/* Compact entry of a static script, naming its register by a peripheral id
+ * and an offset: one access of at most 32 bits, packed in 8 bytes. The ids
+ * are bound to peripheral instances by regtest_bind() */
+struct POp {
+    constexpr POp(uint8_t periph, uint16_t off, uint8_t kind, uint32_t val)
+        : val(val), off(off), periph(periph), kind(kind) {}
     uint32_t val;
-    bool   write;
+    uint16_t off;
+    uint8_t  periph;
+    uint8_t  kind;
+};
+
+static_assert(sizeof(POp) == 8, "POp entries are packed in 8 bytes");
+
+/* Offset of a register in a POp, checked at compile time to fit */
+template <size_t off, size_t size>
+struct POpOff {
+    static_assert(off <= 0xffff, "POp offsets are limited to 16 bits");
+    static_assert(size <= 4, "POp registers are limited to 32 bits");
+    static constexpr uint16_t value = off;
+};
+
+#define POP_OFF_(type, reg) \
+    regtest::POpOff<offsetof(type, reg), sizeof(((type*) 0)->reg)>::value
+#define PERIPH_READ(id, type, reg, val) \
+    regtest::POp(id, POP_OFF_(type, reg), SCRIPT_KIND_(type, reg), val)
+#define PERIPH_WRITE(id, type, reg, val)                                       \
+    regtest::POp(id, POP_OFF_(type, reg),                                      \
+                 SCRIPT_KIND_(type, reg) | regtest::ROP_WRITE, val)
+
+/* Base address of each peripheral id */
+extern thread_local const volatile void *periph_bases[256];
+
+void regtest_bind(uint8_t periph, const volatile void *base);
+
+/* Position in the entries of a ROP_SCRIPT operation: "base" is the index of
+ * the first access of entry "e" in the operation, which is negative for the
+ * current entry when some of its accesses already occurred. */
+struct ScriptCursor {
+    const SOp *e;
+    int64_t    base;
+};
+
+/* Queue of expected operations, stored as a ring buffer in one contiguous
+ * array. The capacity is a power of two that only grows, so once enough room
+ * has been reserved, queuing and consuming operations never allocates. */
+class RopRing {
+  public:
+    RopRing() : head(0), tail(0) {}
+    bool empty() const { return head == tail; }
+    size_t size() const { return tail - head; }
+    ROp& front() { return buf[head & (buf.size() - 1)]; }
+    ROp& operator[](size_t i) { return buf[(head + i) & (buf.size() - 1)]; }
+    void pop() { ++head; }
+    void clear() { head = tail = 0; }
+    void push(const ROp& op) {
+        if (tail - head == buf.size())
+            reserve(buf.size() + 1);
+        buf[tail++ & (buf.size() - 1)] = op;
+    }
+    template <typename... Args> void emplace(Args&&... args) {
+        push(ROp(std::forward<Args>(args)...));
+    }
+    void reserve(size_t n);
+    void save(std::vector<ROp> &ops);
+    void assign(const std::vector<ROp> &ops);
+  private:
+    std::vector<ROp> buf;
+    size_t head;
+    size_t tail;
+};
+
+
+/* Access modes. In REGTEST_CHECK mode, every register access is checked
+ * against the head of the queue as it happens. In REGTEST_DEFERRED mode,
+ * accesses are only appended to the access log of their stream (reads being
+ * served in order from the read operations of its queue), and expect_rest() checks
+ * the whole log against the queue at once. In REGTEST_RECORD mode, nothing is
+ * checked: accesses go to the underlying memory and are appended to the
+ * binary trace opened by trace_record(). */
+enum RegMode { REGTEST_CHECK, REGTEST_DEFERRED, REGTEST_RECORD };
+
+extern thread_local RegMode regmode;
+
+/* One access as observed by a mock register: same layout as the expected
+ * operations, without the run length. */
+struct Access {
+    const volatile void *adr;
+    uint64_t val;
+    uint8_t  kind;
+};
+
+/* Address ranges [begin, end) kept sorted by start address in a vector, with
+ * a lookup by binary search. "last" remembers the last range found, since
+ * drivers tend to access the same peripheral several times in a row. */
+template <typename R>
+R* range_find(std::vector<R> &ranges, R *&last, uintptr_t a) {
+    if (last && a >= last->begin && a < last->end)
+        return last;
+    size_t lo = 0, hi = ranges.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ranges[mid].begin <= a)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo && a < ranges[lo - 1].end)
+        return last = &ranges[lo - 1];
+    return nullptr;
+}
+
+/* Insert "r" in order, unless it overlaps one of the ranges */
+template <typename R>
+bool range_insert(std::vector<R> &ranges, R *&last, const R &r) {
+    size_t i = 0;
+    while (i < ranges.size() && ranges[i].begin < r.begin)
+        i++;
+    if ((i && ranges[i - 1].end > r.begin) ||
+        (i < ranges.size() && ranges[i].begin < r.end))
+        return false;
+    ranges.insert(ranges.begin() + i, r);
+    last = nullptr;
+    return true;
+}
+
+/* Expectation stream: a queue of expected operations with its own order, and
+ * the deferred mode state that goes with it: the access log, and the position
+ * of the next read operation to serve in the queue (operation index, reads
+ * already served from that operation). The default stream "ropq" gets all the
+ * accesses that fall outside of the address ranges of the other streams. */
+class RegModel;
+
+class RegStream : public RopRing {
+  public:
+    RegStream() : checked(0), log_base(0), rd_op(0), rd_done(0),
+                  model(nullptr), rd_script{nullptr, 0}, rd_script_op(0) {}
+    RegStream(const volatile void *base, size_t size);
+    ~RegStream();
+    RegStream(const RegStream&) = delete;
+    RegStream& operator=(const RegStream&) = delete;
+
+    std::vector<Access> log;
+    /* Accesses checked in REGTEST_CHECK mode since the last expect_rest(),
+     * and how many of them came before log[0], for the positions printed */
+    uint64_t checked;
+    uint64_t log_base;
+    size_t   rd_op;
+    uint32_t rd_done;
+    RegModel *model;
+    /* Cursor of deferred reads in the ROP_SCRIPT operation rd_op, if any */
+    ScriptCursor rd_script;
+    size_t   rd_script_op;
+};
+
+/* Behavioral model of a peripheral: the accesses to the address range of the
+ * model are handed to its on_read and on_write hooks instead of being checked
+ * against a queue. */
+class RegModel : public RegStream {
+  public:
+    RegModel(const volatile void *base, size_t size) : RegStream(base, size) {
+        model = this;
+    }
+    virtual ~RegModel() {}
+    virtual uint64_t on_read(const volatile void *adr) = 0;
+    virtual void on_write(const volatile void *adr, uint64_t val) = 0;
 };
 
 /* We queue the expected operation in this variable. Expect_read/write enqueues
  * here, the Reg32 operations dequeue from here. */
-std::queue<ROp> ropq;
+extern thread_local RegStream ropq;
+
+/* Address ranges of the streams other than ropq */
+struct StreamRange {
+    uintptr_t  begin;
+    uintptr_t  end;
+    RegStream *stream;
+};
+
+extern thread_local std::vector<StreamRange> regstreams;
+extern thread_local StreamRange *regstream_last;
 
+/* Search of regstreams behind reg_route, out of line */
+REGTEST_NOINLINE RegStream& reg_route_find(const volatile void *adr);
 
-void expect_read(const volatile uint32_t* adr, uint32_t val) {
-    ropq.emplace(adr, val, false);
+/* Stream of the register at address adr. Kept inline, since the mock
+ * registers call it on every access */
+inline RegStream& reg_route(const volatile void *adr) {
+    if (REGTEST_LIKELY(regstreams.empty()))
+        return ropq;
+    return reg_route_find(adr);
 }
 
-void expect_write(const volatile uint32_t* adr, uint32_t val) {
-    ropq.emplace(adr, val, true);
+/* Binary trace file format: a TraceHdr, followed by one TraceRec per access.
+ * Addresses are stored relative to the base given to trace_record(), so that
+ * a trace may be replayed against registers located elsewhere. The low byte of
+ * "seq" holds the kind of the access (as in ROp), the upper bytes hold its
+ * sequence number. */
+struct TraceHdr {
+    char     magic[8];
+    uint32_t version;
+    uint32_t recsize;
+};
+
+struct TraceRec {
+    uint64_t adr;
+    uint64_t val;
+    uint64_t seq;
+};
+
+/* Recorded accesses are stored in trace_buf, and written to the file one
+ * whole block at a time. */
+enum { TRACE_BLOCK = 16384 };
+
+extern thread_local FILE     *trace_file;
+extern thread_local uintptr_t trace_base;
+extern thread_local uint64_t  trace_seq;
+extern thread_local size_t    trace_len;
+extern thread_local std::vector<TraceRec> trace_buf;
+
+void trace_flush();
+
+void trace_access(const volatile void *adr, uint64_t val, uint8_t kind);
+
+/* Start recording all accesses to the trace file "path", and switch to
+ * REGTEST_RECORD mode. Addresses are recorded relative to "base". */
+int trace_record(const char *path, const volatile void *base = nullptr);
+
+/* Write the pending records, close the trace and go back to REGTEST_CHECK. */
+int trace_stop();
+
+/* Unordered group of expected operations (see expect_group_begin). The group
+ * has at most 64 members, and "pending" has one bit set for each member not
+ * fully consumed yet. The index maps each address to the bit mask of the
+ * members at that address, so that an access only considers these members
+ * instead of scanning the whole group. Check mode consumes the group through
+ * "left" and "pending", deferred mode serves reads through "rd_left" and
+ * "rd_pending". */
+struct RegGroup {
+    enum { MAX = 64, SLOTS = 128 };
+    struct Slot {
+        const volatile void *adr;
+        uint64_t mask;
+    };
+
+    RegGroup() : total(0), pending(0), rd_pending(0) {
+        memset(index, 0, sizeof index);
+    }
+    void add(const ROp &op);
+    uint64_t members(const volatile void *adr) const;
+    int find(uint64_t pending, const uint32_t *left, const volatile void *adr,
+             uint64_t v, uint8_t kind) const;
+    uint64_t value(int i, const uint32_t *left) const {
+        return left[i] == 1 ? ops[i].last : ops[i].val;
+    }
+
+    std::vector<ROp> ops;
+    std::vector<uint32_t> left;
+    std::vector<uint32_t> rd_left;
+    uint32_t total;
+    uint64_t pending;
+    uint64_t rd_pending;
+    Slot index[SLOTS];
+};
+
+/* Groups are allocated when opened, and freed with the other script storage
+ * once all the queues are empty. */
+extern thread_local std::vector<RegGroup*> reggroups;
+extern thread_local RegGroup *reggroup_open;
+/* Number of groups begun within the open one, which are part of it */
+extern thread_local unsigned reggroup_depth;
+
+/* Generator of read values (see expect_read_gen). RegGenOf<F> holds a copy of
+ * the callable, and "next" calls it directly, so that the callable is inlined
+ * there and each read costs a single indirect call. */
+struct RegGen {
+    uint64_t (*next)(RegGen *g);
+    void (*destroy)(RegGen *g);
+    uint8_t kind;
+};
+
+template <typename F>
+struct RegGenOf : RegGen {
+    RegGenOf(const F &fn, uint8_t k) : fn(fn) {
+        next = call;
+        destroy = release;
+        kind = k;
+    }
+    static uint64_t call(RegGen *g) {
+        return (uint64_t) static_cast<RegGenOf*>(g)->fn();
+    }
+    static void release(RegGen *g) {
+        delete static_cast<RegGenOf*>(g);
+    }
+    F fn;
+};
+
+extern thread_local std::vector<RegGen*> reggens;
+
+/* Traces replayed by expect_from_trace() stay mapped until the queues are
+ * emptied. */
+extern thread_local std::vector<std::pair<void*, size_t> > trace_maps;
+
+/* Release the storage of the scripts (traces, groups and generators), once no
+ * queue refers to it anymore. */
+void script_release();
+
+/* Map the trace file "path" and queue its records as expected operations,
+ * with addresses relative to "base". The records are used in place. */
+int expect_from_trace(const char *path, const volatile void *base = nullptr);
+
+/* Expected access number k of the trace operation op */
+Access trace_op_access(const ROp &op, uint32_t k);
+
+/* Access k of a ROP_BLOCK operation */
+Access block_op_access(const ROp &op, uint32_t k);
+
+ScriptCursor script_cursor(const ROp &op);
+
+/* Access k of a ROP_SCRIPT operation, found from cursor c on, which moves to
+ * the entry of this access */
+Access script_op_access(const ROp &op, ScriptCursor &c, uint32_t k);
+
+/* Access k of a ROP_PSCRIPT operation */
+Access pscript_op_access(const ROp &op, uint32_t k);
+
+void regtest_set_mode(RegMode mode);
+
+void expect_reserve(size_t n);
+
+/* Deferred mode read: log the access and serve the next read value of the
+ * stream, whatever its address (mismatches are reported by expect_rest). */
+uint64_t deferred_read(RegStream &s, const volatile void *adr, uint8_t kind);
+
+/* Count the accesses of the log from index j on that match the operation op,
+ * up to op.count. */
+size_t match_op(const std::vector<Access> &log, const ROp &op, size_t j);
+
+/* The expected accesses of the operations of a queue from a given one on,
+ * indexed through the running total of their counts. */
+struct ExpSeq {
+    /* Accesses of one operation, or of one entry of a ROP_SCRIPT operation,
+     * which start at index k0 of the operation */
+    struct Seg {
+        size_t op;
+        size_t k0;
+        ScriptCursor script;
+    };
+    ExpSeq(RegStream &s, size_t op);
+    size_t size() const { return ends.empty() ? 0 : ends.back(); }
+    const ROp& find(size_t e, size_t &k, ScriptCursor &c) const;
+    Access access(size_t e, const ROp *&op) const;
+    bool match(size_t e, const Access &a) const;
+    void print(FILE *out, const char *what, size_t e) const;
+    RegStream &s;
+    std::vector<size_t> ends;
+    std::vector<Seg> segs;
+};
+
+/* Minimal edit script between the expected accesses and the accesses of the
+ * log, with the linear space variant of the Myers diff algorithm: the middle
+ * snake of the edit graph splits the problem in two, recursively. Its forward
+ * and backward furthest reaching paths are the only memory used. The work is
+ * bounded, so as to give up in reasonable time on traces that diverge too
+ * much. */
+class RegDiff {
+  public:
+    RegDiff(const ExpSeq &exp, const std::vector<Access> &log, size_t j,
+                                                               FILE *out);
+    bool run();
+    size_t missing;
+    size_t extra;
+  private:
+    enum { SHOWN = 20 };
+    bool eq(size_t a, size_t b) { work++; return exp.match(a, log[b0 + b]); }
+    bool snake(size_t a0, size_t a1, size_t b0, size_t b1, size_t snk[4]);
+    void diff(size_t a0, size_t a1, size_t b0, size_t b1);
+    void edit(bool del, size_t a, size_t b);
+    const ExpSeq &exp;
+    const std::vector<Access> &log;
+    size_t b0;
+    FILE *out;
+    std::vector<ptrdiff_t> vf;
+    std::vector<ptrdiff_t> vb;
+    uint64_t work;
+    uint64_t max_work;
+};
+
+/* In REGTEST_FAIL_CONTINUE policy, the first failure of REGTEST_CHECK mode
+ * switches to REGTEST_DEFERRED mode until expect_rest(), which then shows
+ * the differences between the rest of the script and the accesses. */
+extern thread_local bool regcheck_resume;
+
+/* Check the access log of a stream against its queue in one pass, then empty
+ * both. On failure, the differences are shown when the queue and the log may
+ * still be compared, that is once the failure is let through. */
+int deferred_rest(RegStream &s);
+
+
+/* Optional instrumentation of the accesses. Each enabled feature sets its bit
+ * in "reghooks", so that the mock registers test a single flag and only call
+ * access_hooks() when some instrumentation is enabled. */
+enum { HOOK_STATS = 1, HOOK_BUS = 2, HOOK_IRQ = 4, HOOK_BUDGET = 8,
+       HOOK_ANALYZE = 16, HOOK_LOG = 32 };
+
+extern thread_local unsigned reghooks;
+
+/* Per register access counters, kept in an open addressing hash table with
+ * linear probing (a null address marks a free slot). */
+struct RegStat {
+    const volatile void *adr;
+    uint64_t reads;
+    uint64_t writes;
+};
+
+extern thread_local std::vector<RegStat> regstats;
+extern thread_local size_t regstats_used;
+
+/* Find the slot of "adr", adding it (and growing the table) if needed */
+RegStat& regstat_slot(const volatile void *adr);
+
+void regstat_count(const volatile void *adr, uint8_t kind);
+
+void regstats_enable(bool on);
+
+void regstats_clear();
+
+/* Print the counters, most accessed registers first */
+void regstats_report(FILE *out = stdout);
+
+/* Virtual bus time: each access advances the clock "bus_clock" by the cost of
+ * the address range it falls in, or by the default cost. */
+struct BusRange {
+    uintptr_t begin;
+    uintptr_t end;
+    uint32_t  read_cycles;
+    uint32_t  write_cycles;
+};
+
+extern thread_local std::vector<BusRange> bus_ranges;
+extern thread_local BusRange *bus_last;
+extern thread_local uint32_t bus_default_read;
+extern thread_local uint32_t bus_default_write;
+extern thread_local uint64_t bus_clock;
+extern thread_local uint64_t bus_budget;
+
+/* Set the cost of the accesses to [adr, adr + size). Fail if the range
+ * overlaps another one */
+void bus_cost(const volatile void *adr, size_t size, uint32_t read_cycles,
+                                                     uint32_t write_cycles);
+
+/* Set the cost of the accesses outside of all ranges */
+void bus_cost_default(uint32_t read_cycles, uint32_t write_cycles);
+
+/* Make the next expect_rest() fail if the bus time exceeds "cycles" */
+void expect_bus_budget(uint64_t cycles);
+
+uint64_t bus_time();
+
+void bus_access(const volatile void *adr, uint8_t kind);
+
+/* Report the bus time of the test and restart the clock */
+int bus_rest();
+
+/* Access budgets, against runaway loops: a test may make at most
+ * "budget_limit" accesses (0 for no limit), and at most "limit" accesses to
+ * each budget range. The last accesses are kept in a small ring, so as to
+ * show where the test was stuck. */
+struct BudgetRange {
+    uintptr_t begin;
+    uintptr_t end;
+    uint64_t  limit;
+    uint64_t  used;
+};
+
+enum { HISTORY_SIZE = 16 };
+
+extern thread_local std::vector<BudgetRange> budget_ranges;
+extern thread_local BudgetRange *budget_last;
+extern thread_local uint64_t budget_limit;
+extern thread_local uint64_t budget_used;
+extern thread_local Access history[HISTORY_SIZE];
+
+/* Fail once the test makes more than "accesses" register accesses */
+void expect_access_budget(uint64_t accesses);
+
+/* Fail once the test makes more than "accesses" accesses to [adr, adr + size).
+ * Fail if the range overlaps another one */
+void expect_access_budget(const volatile void *adr, size_t size,
+                                                    uint64_t accesses);
+
+/* Print the last accesses of the test, oldest first */
+void access_history_report(FILE *out = stdout);
+
+/* A loop which exceeds its budget would go on spinning if the failure was let
+ * through, so the test program is then aborted. */
+REGTEST_COLD
+void budget_exceeded(const volatile void *adr, uint64_t limit);
+
+void budget_access(const volatile void *adr, uint8_t kind);
+
+/* Restart the budgets of the next test */
+void budget_rest();
+
+/* Analysis of the access patterns of the tested code, looking for wasteful
+ * bus traffic. Each access is compared with the previous one, and findings
+ * are aggregated per pattern and address, along with the position (the number
+ * of accesses before it) of the first access of their first occurrence. */
+enum { PAT_READ_AFTER_WRITE, PAT_SAME_WRITE, PAT_BUSY_POLL,
+       PAT_MERGEABLE_WRITES };
+
+struct RegFinding {
+    int      pattern;
+    const volatile void *adr;
+    uint64_t count;
+    uint64_t first;
+    uint64_t accesses;
+};
+
+/* Shortest run of back to back reads of one register counted as busy polling
+ */
+enum { BUSY_POLL_READS = 16 };
+
+extern thread_local std::vector<RegFinding> findings;
+extern thread_local Access analyze_prev;
+extern thread_local uint64_t analyze_seq;
+extern thread_local uint64_t analyze_run;
+
+void regtest_analyze_enable(bool on);
+
+void finding_add(int pattern, const volatile void *adr, uint64_t first,
+                                                        uint64_t accesses);
+
+/* Values of reads do not matter to the patterns, they are passed as 0 */
+void analyze_access(const volatile void *adr, uint64_t v, uint8_t kind);
+
+/* Print the findings, most costly first */
+void analysis_report(FILE *out = stdout);
+
+void analysis_clear();
+
+/* Analyze a whole access log, such as the log of a stream in deferred mode
+ * or the accesses of another process */
+void analyze_log(const std::vector<Access> &log, FILE *out = stdout);
+
+void access_hooks(const volatile void *adr, uint64_t v, uint8_t kind);
+
+
+/* Destination of the output of the library: failure messages, reports and,
+ * when enabled, a log of every access. Without one, the output is written to
+ * stdout as it is produced. */
+class RegSink {
+  public:
+    virtual ~RegSink() {}
+    virtual void text(const char *s, size_t len) = 0;
+    virtual void access(uint64_t seq, const Access &a) = 0;
+    virtual void flush() {}
+};
+
+/* Plain text to a stdio stream, or to a file created at path */
+class RegFileSink : public RegSink {
+  public:
+    explicit RegFileSink(FILE *f = stdout) : f(f), own(false) {}
+    explicit RegFileSink(const char *path);
+    virtual ~RegFileSink();
+    void text(const char *s, size_t len);
+    void access(uint64_t seq, const Access &a);
+    void flush();
+  protected:
+    FILE *f;
+    bool own;
+};
+
+/* JSON lines: one {"msg": ...} object per line of text, and one {"seq": ...,
+ * "op": ..., "size": ..., "adr": ..., "val": ...} object per access */
+class RegJsonSink : public RegFileSink {
+  public:
+    explicit RegJsonSink(FILE *f = stdout) : RegFileSink(f) {}
+    explicit RegJsonSink(const char *path) : RegFileSink(path) {}
+    ~RegJsonSink();
+    void text(const char *s, size_t len);
+    void access(uint64_t seq, const Access &a);
+  private:
+    void message();
+    std::vector<char> line;
+};
+
+/* Forward the output to another sink from a background thread. Each thread
+ * that produces output gets its own lock-free ring of "size" bytes, which it
+ * fills and the background thread drains, so that producing output costs a
+ * copy into the ring. A full ring makes the producer wait. A forked child has
+ * no background thread, and forwards its output synchronously. */
+class RegAsyncSink : public RegSink {
+  public:
+    explicit RegAsyncSink(RegSink &out, size_t size = 1 << 20);
+    ~RegAsyncSink();
+    RegAsyncSink(const RegAsyncSink&) = delete;
+    RegAsyncSink& operator=(const RegAsyncSink&) = delete;
+    void text(const char *s, size_t len);
+    void access(uint64_t seq, const Access &a);
+    /* Wait until the output produced so far is drained and out flushed */
+    void flush();
+  private:
+    struct Ring {
+        explicit Ring(size_t size) : buf(size), head(0), tail(0) {}
+        std::vector<char> buf;
+        std::atomic<size_t> head;        // advanced by the drain
+        std::atomic<size_t> tail;        // advanced by the producer
+    };
+    Ring& ring();
+    void push(uint32_t type, const void *p, size_t len);
+    bool drain_rings();
+    void drain();
+    struct Thread;                       // in regtest.cc, with <thread>
+    RegSink &out;
+    size_t size;
+    uint64_t id;                         // tells the sinks apart in ring()
+    unsigned forks;                      // fork generation of the drain
+    std::vector<Ring*> rings;
+    std::vector<char> tmp;
+    Thread *thread;                      // the drain, and the lock of rings
+    std::atomic<bool> stop;
+    std::atomic<uint64_t> flush_req;
+    std::atomic<uint64_t> flush_done;
+};
+
+extern thread_local RegSink *regsink;
+
+/* Send the output of the calling thread to sink, or to stdout if nullptr */
+void regtest_set_sink(RegSink *sink);
+
+/* Output of the library, to the sink of the calling thread. The reports that
+ * take a stream go to the sink when that stream is stdout. */
+__attribute__((format(printf, 1, 2)))
+void regtest_print(const char *fmt, ...);
+
+__attribute__((format(printf, 2, 3)))
+void regtest_fprint(FILE *out, const char *fmt, ...);
+
+void regtest_write(const char *s, size_t len);
+
+/* Flush the sink and stdout, before a failure stops the test or a fork */
+void regtest_flush();
+
+/* Number of the next access sent to the sink */
+extern thread_local uint64_t reglog_seq;
+
+/* Send every access, with its value, to the sink */
+void regtest_log_accesses(bool on);
+
+void log_access(const volatile void *adr, uint64_t v, uint8_t kind);
+
+/* Script side of a shared memory transport, when bound by expect_to_shm() */
+class RegShm;
+extern thread_local RegShm *regshm_out;
+void shm_push(RegShm *shm, const ROp &op);
+
+/* Queue one expected operation: to the shared memory transport if bound, in
+ * the unordered group being built if any, otherwise in the stream of its
+ * address. */
+void rop_queue(const ROp &op);
+
+void expect_group_begin();
+
+void expect_group_end();
+
+/* Scope of an expect_any_order block */
+struct RegGroupScope {
+    RegGroupScope() : done(false) { expect_group_begin(); }
+    ~RegGroupScope() { expect_group_end(); }
+    bool once() { bool first = !done; done = true; return first; }
+    bool done;
+};
+
+#define expect_any_order \
+    for (regtest::RegGroupScope regtest_group_; regtest_group_.once(); )
+
+/* Helper keeping the value parameter of the expect_* templates out of template
+ * argument deduction: the register type alone decides the width, and the
+ * value is converted to it (this allows expect_read(&periph->isr, 0x01)). */
+template <typename T> struct RegVal { typedef T type; };
+
+template <typename T>
+void expect_read(const volatile T* adr, typename RegVal<T>::type val) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    rop_queue(ROp(adr, val, val, 1, sizeof(T)));
+}
+
+template <typename T>
+void expect_write(const volatile T* adr, typename RegVal<T>::type val) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    rop_queue(ROp(adr, val, val, 1, sizeof(T) | ROP_WRITE));
+}
+
+template <typename T>
+void expect_read_n(const volatile T* adr, typename RegVal<T>::type val,
+                   uint32_t count) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    if (count)
+        rop_queue(ROp(adr, val, val, count, sizeof(T)));
+}
+
+template <typename T>
+void expect_poll_until(const volatile T* adr, typename RegVal<T>::type idle_val,
+                       typename RegVal<T>::type done_val, uint32_t reads) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    if (reads)
+        rop_queue(ROp(adr, idle_val, done_val, reads, sizeof(T)));
+}
+
+/* Expect "count" writes (or reads) at adr, of the successive values of buf.
+ * The buffer is not copied, and must be kept until these accesses occur. */
+template <typename T>
+void expect_write_block(const volatile T* adr,
+                        const typename RegVal<T>::type *buf, uint32_t count) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    ROp op(ROP_BLOCK, adr, buf, count);
+    op.val = sizeof(T) | ROP_WRITE;
+    if (count)
+        rop_queue(op);
+}
+
+template <typename T>
+void expect_read_block(const volatile T* adr,
+                       const typename RegVal<T>::type *buf, uint32_t count) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    ROp op(ROP_BLOCK, adr, buf, count);
+    op.val = sizeof(T);
+    if (count)
+        rop_queue(op);
+}
+
+/* Expect the accesses of a static script of "n" entries, to the peripheral
+ * at "base". The script is consumed in place, and must be kept until these
+ * accesses occur. */
+void expect_script(const volatile void *base, const SOp *script, size_t n);
+
+template <size_t N>
+void expect_script(const volatile void *base, const SOp (&script)[N]) {
+    expect_script(base, script, N);
 }
 
-int expect_rest() {
-    if (!ropq.empty()) {
-        printf("\nExpected register operation(s) did not occur.\n");
-        raise(SIGINT);
-        return 1;
+/* Expect the accesses of a static script of "n" compact entries, to the
+ * peripherals currently bound to their ids. The script is consumed in place.
+ */
+void expect_script(const POp *script, size_t n);
+
+template <size_t N>
+void expect_script(const POp (&script)[N]) {
+    expect_script(script, N);
+}
+
+/* Source of expected operations produced while the tested code runs. front()
+ * waits for the next operation, and returns nullptr once the source is closed
+ * and drained. Each access checked against the source is also passed to
+ * log(). */
+class RegSource {
+  public:
+    virtual ~RegSource() {}
+    virtual ROp* front() = 0;
+    virtual void pop() = 0;
+    virtual void log(const volatile void *adr, uint64_t v, uint8_t kind) {
+        (void) adr; (void) v; (void) kind;
     }
-    return 0;
+};
+
+/* Single producer, single consumer channel of expected operations, for a
+ * simulator thread to feed the expectations of the tested code while it runs
+ * (see expect_from_channel). The operations are stored in a fixed size ring:
+ * the producer only writes "tail" and the consumer only writes "head", so that
+ * neither ever takes a lock while the ring is neither full nor empty. Past a
+ * short spin, a side that has to wait for the other sleeps on "cv"; the other
+ * side only takes the lock to wake it up when "sleepers" says so. */
+class RegChannel : public RegSource {
+  public:
+    explicit RegChannel(size_t capacity = 4096);
+    ~RegChannel();
+    RegChannel(const RegChannel&) = delete;
+    RegChannel& operator=(const RegChannel&) = delete;
+
+    /* Producer side */
+    void push(const ROp &op);
+    void close();
+    template <typename T>
+    void expect_read(const volatile T* adr, typename RegVal<T>::type val) {
+        push(ROp(adr, val, val, 1, sizeof(T)));
+    }
+    template <typename T>
+    void expect_write(const volatile T* adr, typename RegVal<T>::type val) {
+        push(ROp(adr, val, val, 1, sizeof(T) | ROP_WRITE));
+    }
+    template <typename T>
+    void expect_poll_until(const volatile T* adr, typename RegVal<T>::type idle,
+                           typename RegVal<T>::type done, uint32_t reads) {
+        if (reads)
+            push(ROp(adr, idle, done, reads, sizeof(T)));
+    }
+
+    /* Consumer side: the next operation, or nullptr once the channel is
+     * closed and drained. */
+    ROp* front() override;
+    void pop() override;
+
+  private:
+    enum { SPINS = 1000 };
+    struct Sleep;                        // in regtest.cc, with <mutex>
+    template <typename Ready> void wait(Ready ready);
+    void wake();
+
+    std::vector<ROp> buf;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    std::atomic<bool> closed;
+    std::atomic<int> sleepers;
+    Sleep *sleep;
+};
+
+/* Expect all the operations pushed to the channel until it is closed. They
+ * are consumed as the tested code runs, in REGTEST_CHECK mode. */
+void expect_from_channel(RegChannel &ch, const volatile void *adr = nullptr);
+
+/* Shared memory transport, for tested code running in another process than
+ * the test script. The shared region holds a ShmHdr followed by two single
+ * producer, single consumer rings: the expected operations, sent by the script
+ * to the tested process, and the access log, sent back by the tested process.
+ * Addresses are relative to the base given by each side, and each side only
+ * makes system calls when it has to wait for the other. */
+struct ShmOp {
+    uint64_t adr;
+    uint64_t val;
+    uint64_t last;
+    uint32_t count;
+    uint32_t kind;
+};
+
+struct ShmHdr {
+    char     magic[8];
+    uint32_t version;
+    uint32_t capacity;
+    alignas(64) std::atomic<uint64_t> exp_head;
+    alignas(64) std::atomic<uint64_t> exp_tail;
+    alignas(64) std::atomic<uint64_t> log_head;
+    alignas(64) std::atomic<uint64_t> log_tail;
+    alignas(64) std::atomic<uint32_t> exp_closed;
+    std::atomic<uint32_t> log_closed;
+    std::atomic<int32_t>  status;
+    std::atomic<int32_t>  script_pid;
+    std::atomic<int32_t>  tested_pid;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "The shared memory transport needs lock-free atomics");
+
+class RegShm : public RegSource {
+  public:
+    RegShm() : hdr(nullptr), size(0), base(0), owner(false), has_cur(false),
+                                                         seq(0), next(0) {}
+    ~RegShm();
+    RegShm(const RegShm&) = delete;
+    RegShm& operator=(const RegShm&) = delete;
+
+    /* Script side */
+    int create(const char *name, const volatile void *base = nullptr,
+                                 size_t capacity = 65536);
+    void push(const ROp &op);
+    bool next_access(Access &a);
+    int rest();
+
+    /* Tested side */
+    int open(const char *name, const volatile void *base = nullptr);
+    ROp* front() override;
+    void pop() override;
+    void log(const volatile void *adr, uint64_t v, uint8_t kind) override;
+
+    /* Script side: no more expected operations. Tested side: no more
+     * accesses, and "status" tells whether the test passed. */
+    void close(int status = 0);
+
+  private:
+    int map(int fd, const char *name);
+    template <typename Ready> bool wait(Ready ready);
+    void drain();
+
+    ShmHdr   *hdr;
+    ShmOp    *exp;
+    TraceRec *acc;
+    size_t    size;
+    size_t    mask;
+    uintptr_t base;
+    bool      owner;
+    bool      has_cur;
+    ROp       cur;
+    uint64_t  seq;
+    char      name[64];
+
+    /* Script side: accesses of the tested process, next_access() returns
+     * accesses[next] */
+    std::vector<Access> accesses;
+    size_t              next;
+
+    friend void expect_to_shm(RegShm &shm);
+};
+
+void shm_push(RegShm *shm, const ROp &op);
+
+/* Script side: send the operations expected from now on to the tested
+ * process, until expect_rest(). */
+void expect_to_shm(RegShm &shm);
+
+/* Tested side: expect the operations sent by the script */
+void expect_from_shm(RegShm &shm, const volatile void *adr = nullptr);
+
+/* Expect "count" reads at adr, each yielding the value returned by fn() when
+ * the read occurs. */
+template <typename T, typename F>
+void expect_read_gen(const volatile T* adr, uint32_t count, F fn) {
+#ifdef REGTEST_PASSTHROUGH
+    return;
+#endif
+    if (!count)
+        return;
+    RegGenOf<F> *g = new RegGenOf<F>(fn, sizeof(T));
+    reggens.push_back(g);
+    rop_queue(ROp(ROP_GEN, adr, g, count));
 }
 
+/* Interrupt handlers queued and not run yet. While there are some, HOOK_IRQ
+ * sends every access to the slow path, which runs each handler as soon as the
+ * stream reaches it. */
+extern thread_local size_t regirqs;
+
+/* Run handler() right after the operations expected so far in the stream of
+ * adr, before the next access, as an interrupt would. */
+void expect_interrupt(void (*handler)(), const volatile void *adr = nullptr);
 
-class Reg32 {
+int stream_rest(RegStream &s);
+
+/* Number of live checkpoints, which keep the groups, generators and traces of
+ * the script from being released */
+extern thread_local unsigned regcheckpoints;
+
+int expect_rest();
+
+
+/* Snapshot of the expectations of every stream, such as a common prefix of
+ * many tests: restore() puts the queues, their logs and the state of their
+ * groups back as they were when the checkpoint was taken, with one copy per
+ * stream. The streams must outlive the checkpoint. */
+class RegCheckpoint {
   public:
-    Reg32() = delete;
-    Reg32& operator=(const Reg32& rhs) = delete;
-    uint32_t operator=(uint32_t v) volatile;
-    const volatile uint32_t* operator&() const volatile;
-    operator uint32_t() volatile;
+    RegCheckpoint();
+    ~RegCheckpoint() { regcheckpoints--; }
+    RegCheckpoint(const RegCheckpoint&) = delete;
+    RegCheckpoint& operator=(const RegCheckpoint&) = delete;
+    void restore();
   private:
-    uint32_t v;
+    struct Saved {
+        RegStream *stream;
+        std::vector<ROp> ops;
+        std::vector<Access> log;
+        uint64_t checked;
+        uint64_t log_base;
+        size_t   rd_op;
+        uint32_t rd_done;
+    };
+    void save(RegStream &s);
+    std::vector<Saved> streams;
+    std::vector<std::pair<RegGroup*, RegGroup> > groups;
+    size_t irqs;
 };
 
-/* Assignement operator overload: intercept writes */
-uint32_t Reg32::operator=(uint32_t v) volatile {
-    if (ropq.empty() ||
-        ropq.front().write == false ||
-        ropq.front().adr != &this->v ) {
-        printf("\nUnexpected write of 0x%08x to address %p\n",
-                                 v, (volatile void*)&this->v);
-        raise(SIGINT);
-    } else if(ropq.front().val != v) {
-        printf("\nUnexpected value 0x%08x of write to address %p\n",
-                                       v, (volatile void*)&this->v);
-        raise(SIGINT);
-    } else {
-        ropq.pop();
-    }
 
+/* Test case of the fork-server runner */
+struct RegCase {
+    const char *name;
+    void (*fn)();
+};
+
+/* Cases run by regtest_run(), in the order they were added */
+std::vector<RegCase>& regtest_cases();
+
+void regtest_add_case(const char *name, void (*fn)());
+
+struct RegCaseAdd {
+    RegCaseAdd(const char *name, void (*fn)()) { regtest_add_case(name, fn); }
+};
+
+/* Define a test case, added to the runner before main() starts */
+#define REGTEST_CASE(name)                                  \
+    static void name();                                     \
+    static regtest::RegCaseAdd name##_case(#name, name);    \
+    static void name()
+
+/* Run each case in a child forked from the calling thread, with "jobs"
+ * children at a time (one per online CPU by default), each killed after
+ * "timeout" seconds unless it is 0. The children start from the expectations,
+ * models and fixtures set up so far, and send their output back over a pipe.
+ * Return the number of failed cases. */
+int regtest_run(unsigned jobs = 0, unsigned timeout = 0);
+
+/* Seeded corruption of the values that models and generators provide for
+ * chosen registers, such as the error bits or spurious ready flags of a status
+ * register. Whether the n-th read of a rule is corrupted, and how, only
+ * depends on the seed, the rule and n: a run is reproduced from its seed, and
+ * dropping some of its corruptions leaves the others as they were. */
+class RegFuzz {
+  public:
+    /* Replace the bits of mask by random ones in a fraction "rate" of the
+     * values read at adr */
+    void fuzz(const volatile void *adr, uint64_t mask, double rate);
+    /* Start over with seed, keeping only the corruptions whose ordinals are
+     * in the sorted keep, or all of them without one */
+    void reset(uint64_t seed, const std::vector<uint32_t> *keep = nullptr);
+    uint64_t apply(const volatile void *adr, uint64_t v);
+    uint64_t seed = 0;
+    uint32_t count = 0;                  // corruptions drawn, kept or not
+    volatile uint32_t *shared = nullptr; // copy of count for the runner
+  private:
+    struct Rule {
+        const volatile void *adr;
+        uint64_t mask;
+        uint64_t threshold;
+        uint64_t key;
+        uint64_t reads;
+    };
+    std::vector<Rule> rules;
+    std::vector<uint32_t> keep;
+    bool keep_all = true;
+    size_t next_keep = 0;
+};
+
+/* Fuzzer applied to the reads of models and generators, if any */
+extern thread_local RegFuzz *regfuzz;
+
+/* Run fn() followed by expect_rest() under the seeds first to first + count -
+ * 1, each in a child forked as by regtest_run(). The corruptions of a failing
+ * seed are minimized, and its reduced run is printed. With REGTEST_FUZZ set to
+ * "seed" or "seed:ordinal,...", only that run is made, in this process.
+ * Return the number of failed seeds. */
+int regtest_fuzz(RegFuzz &fuzz, void (*fn)(), uint64_t first, uint64_t count,
+                 unsigned jobs = 0, unsigned timeout = 0);
+
+/* Plain memory accesses of REGTEST_RECORD mode */
+void mem_store(const volatile void *adr, uint64_t v, uint8_t kind);
+
+uint64_t mem_load(const volatile void *adr, uint8_t kind);
+
+/* Check mode access to the unordered group at the head of a queue: consume
+ * the matching member and provide its value, return -1 if none matches. */
+int group_access(RegStream &s, const volatile void *adr, uint64_t v,
+                 uint8_t kind, uint64_t *val = nullptr);
+
+/* Slow paths of the mock registers: instrumentation, models, modes other than
+ * REGTEST_CHECK, queue operations other than ROP_SINGLE, and failures. */
+REGTEST_NOINLINE
+void reg_write(RegStream &s, const volatile void *adr, uint64_t v,
+                                                         uint8_t kind);
+
+REGTEST_NOINLINE
+uint64_t reg_read(RegStream &s, const volatile void *adr, uint8_t kind);
+
+
+/* Mock register of width T. Every width shares the one expectation queue, but
+ * each gets its own access functions, so that the width is never checked at
+ * run time. Accesses go to the stream the register belongs to. */
+template <typename T>
+class RegN {
+  public:
+    RegN() = delete;
+    RegN& operator=(const RegN& rhs) = delete;
+    T operator=(T v) volatile;
+    const volatile T* operator&() const volatile;
+    operator T() volatile;
+  private:
+    T v;
+};
+
+typedef RegN<uint8_t>  Reg8;
+typedef RegN<uint16_t> Reg16;
+typedef RegN<uint32_t> Reg32;
+typedef RegN<uint64_t> Reg64;
+
+/* Assignement operator overload: intercept writes. The expected case of a
+ * matching single operation is handled inline, everything else by reg_write */
+template <typename T>
+T RegN<T>::operator=(T v) volatile {
+#ifdef REGTEST_PASSTHROUGH
+    this->v = v;
     return v;
+#else
+    RegStream &s = reg_route(&this->v);
+    if (REGTEST_LIKELY(regmode == REGTEST_CHECK && !reghooks && !s.empty())) {
+        ROp &op = s.front();
+        if (REGTEST_LIKELY(op.kind == (sizeof(T) | ROP_WRITE) &&
+                           op.adr == &this->v && op.val == v)) {
+            if (--op.count == 0)
+                s.pop();
+            s.checked++;
+            return v;
+        }
+    }
+    reg_write(s, &this->v, v, sizeof(T) | ROP_WRITE);
+    return v;
+#endif
 }
 
 /* Ampersand operator overload: provide the underlying register address */
-const volatile uint32_t* Reg32::operator&() const volatile {
+template <typename T>
+const volatile T* RegN<T>::operator&() const volatile {
     return &this->v;
 }
 
-Reg32::operator uint32_t() volatile {
-    uint32_t ret = (uint32_t) -1;
-    if (ropq.empty() ||
-        ropq.front().write == true ||
-        ropq.front().adr != &this->v) {
-        printf("\nUnexpected read at address %p\n", (volatile void*)&this->v);
-        raise(SIGINT);
-    } else {
-        ret = ropq.front().val;
-        ropq.pop();
+/* Conversion operator overload: intercept reads, same split as writes */
+template <typename T>
+RegN<T>::operator T() volatile {
+#ifdef REGTEST_PASSTHROUGH
+    return this->v;
+#else
+    RegStream &s = reg_route(&this->v);
+    if (REGTEST_LIKELY(regmode == REGTEST_CHECK && !reghooks && !s.empty())) {
+        ROp &op = s.front();
+        if (REGTEST_LIKELY(op.kind == sizeof(T) && op.adr == &this->v)) {
+            T ret = (T) ((op.count == 1) ? op.last : op.val);
+            if (--op.count == 0)
+                s.pop();
+            s.checked++;
+            return ret;
+        }
     }
-    return ret;
+    return (T) reg_read(s, &this->v, sizeof(T));
+#endif
 }
 
+} /* namespace regtest */
+
+/* Interface of the library */
+#if REGTEST_FAIL == REGTEST_FAIL_THROW
+using regtest::RegFailure;
+#endif
+using regtest::regfailures;
+using regtest::regtest_fail;
+using regtest::ROP_WRITE;
+using regtest::Access;
+using regtest::SOp;
+using regtest::POp;
+using regtest::regtest_bind;
+using regtest::RegMode;
+using regtest::REGTEST_CHECK;
+using regtest::REGTEST_DEFERRED;
+using regtest::REGTEST_RECORD;
+using regtest::RegStream;
+using regtest::RegModel;
+using regtest::ropq;
+using regtest::trace_record;
+using regtest::trace_stop;
+using regtest::expect_from_trace;
+using regtest::regtest_set_mode;
+using regtest::expect_reserve;
+using regtest::regstats_enable;
+using regtest::regstats_clear;
+using regtest::regstats_report;
+using regtest::bus_cost;
+using regtest::bus_cost_default;
+using regtest::expect_bus_budget;
+using regtest::bus_time;
+using regtest::expect_access_budget;
+using regtest::access_history_report;
+using regtest::regtest_analyze_enable;
+using regtest::analysis_report;
+using regtest::analysis_clear;
+using regtest::analyze_log;
+using regtest::RegSink;
+using regtest::RegFileSink;
+using regtest::RegJsonSink;
+using regtest::RegAsyncSink;
+using regtest::regtest_set_sink;
+using regtest::regtest_print;
+using regtest::regtest_fprint;
+using regtest::regtest_write;
+using regtest::regtest_flush;
+using regtest::regtest_log_accesses;
+using regtest::expect_group_begin;
+using regtest::expect_group_end;
+using regtest::expect_read;
+using regtest::expect_write;
+using regtest::expect_read_n;
+using regtest::expect_poll_until;
+using regtest::expect_write_block;
+using regtest::expect_read_block;
+using regtest::expect_script;
+using regtest::RegSource;
+using regtest::RegChannel;
+using regtest::expect_from_channel;
+using regtest::RegShm;
+using regtest::expect_to_shm;
+using regtest::expect_from_shm;
+using regtest::expect_read_gen;
+using regtest::expect_interrupt;
+using regtest::expect_rest;
+using regtest::RegCheckpoint;
+using regtest::RegCase;
+using regtest::regtest_cases;
+using regtest::regtest_add_case;
+using regtest::regtest_run;
+using regtest::RegFuzz;
+using regtest::regtest_fuzz;
+using regtest::RegN;
+using regtest::Reg8;
+using regtest::Reg16;
+using regtest::Reg32;
+using regtest::Reg64;
+
+/* Without REGTEST_LIB, the runtime is compiled along with the test */
+#ifndef REGTEST_LIB
+#include "regtest.cc"
+#endif
+
+#endif /* REGTEST_H */